@@ -8,6 +8,8 @@
  * William Grzybowski <william@agencialivre.com.br>
  */
 
+#include <config.h>
+
 #define _XOPEN_SOURCE 500
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,15 +25,53 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
 
 #include <crypt.h>
 #include <gcrypt.h>
 
 #include "backend_pgsql.h"
+#include "badpass.h"
+#include "resolve_cache.h"
+#include "cidr.h"
+#include "replica.h"
+#include "trace.h"
+#include "shm.h"
 #include "pam_pgsql.h"
 
 static char *
-crypt_makesalt(pw_scheme scheme);
+crypt_makesalt(pw_scheme scheme, int rounds);
+
+#if !HAVE_CRYPT_R
+/* crypt() keeps its result in a static buffer */
+static pthread_mutex_t crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Rounds for new crypt_sha512 hashes with target_hash_ms, measured on
+ * this host and measured again every HASH_TUNE_INTERVAL seconds.  The
+ * result is kept in shared memory, so that a passwd run (a process of
+ * its own) doesn't have to measure first; the first caller to find it
+ * out of date measures, the others use the old count meanwhile.
+ */
+#define HASH_TUNE_SHM         "/pam_pgsql_hashtune"
+#define HASH_BENCH_ROUNDS     5000
+#define HASH_TUNE_INTERVAL    3600
+#define HASH_MIN_ROUNDS       1000
+#define HASH_MAX_ROUNDS       999999999
+
+struct hash_tune {
+	pid_t lock;
+	int rounds;
+	int target_ms;
+	time_t tuned;
+};
+
+static pthread_mutex_t hash_tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_tune *hash_tune = NULL;
+static struct hash_tune hash_tune_local;	/* without shared memory */
 
 /* very private: used only in get_module_options */
 static char *
@@ -79,26 +119,362 @@ build_conninfo(modopt_t *options)
 	return str;
 }
 
+/* the connection string of the options, built from the single settings if needed */
+const char *
+db_connstr(modopt_t *options)
+{
+	if(options->connstr == NULL)
+		options->connstr = build_conninfo(options);
+	return options->connstr;
+}
+
+/* private: PAM_SUCCESS if the result is a good one, log it otherwise */
+static int
+result_check(PGresult *res)
+{
+	if(PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK) {
+		SYSLOG("PostgreSQL query failed: '%s'", PQresultErrorMessage(res));
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	return PAM_SUCCESS;
+}
+
+/*
+ * Connection pool.  With pool_size > 0 connections are kept open per
+ * connection string and handed out to at most pool_size callers at a
+ * time; further callers (other threads of the host) wait for one to be
+ * released instead of opening yet another backend.  With pool_size = 0
+ * db_connect()/db_release() simply open and close a connection.
+ *
+ * Configurations that only differ in "role" use the same connection
+ * string and thus the same pooled sessions: the session is switched to
+ * the wanted role with SET ROLE when it is handed out (or back with
+ * RESET ROLE), which is skipped when it already is in the right one.
+ *
+ * Admission: pool_reserved of the pool_size connections are kept for
+ * priority callers (see priority_users and friends), who also go before
+ * everybody else waiting.  Other callers give up after admission_timeout
+ * milliseconds of waiting, so under overload they are shed first while
+ * administrators can still log in.  Nobody waits longer than
+ * POOL_WAIT_MAX milliseconds, not even priority callers.
+ *
+ * A login that only claims to be a priority user is otherwise treated
+ * like everybody else, but may also use half of the reserved
+ * connections (rounded down); the other half is left to the callers
+ * that are known to be priority ones.
+ */
+#define POOL_WAIT_MAX   30000
+
+struct pool_conn {
+	PGconn *conn;
+	char *role;		/* role the session was left in, see db_set_role() */
+	time_t last_used;
+	struct pool_conn *next;
+};
+
+struct pool {
+	char *connstr;
+	pid_t pid;
+	int total;
+	int normal;		/* checked out by non-priority callers */
+	int waiting_priority;
+	pthread_cond_t cond;
+	struct pool_conn *idle;
+	struct pool *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *pools = NULL;
+
+/* private: called with pool_lock held */
+static struct pool *
+pool_find(const char *connstr)
+{
+	struct pool *p;
+
+	for (p = pools; p != NULL; p = p->next)
+		if (!strcmp(p->connstr, connstr))
+			break;
+
+	if (p == NULL) {
+		p = calloc(1, sizeof(struct pool));
+		p->connstr = strdup(connstr);
+		p->pid = getpid();
+		pthread_cond_init(&p->cond, NULL);
+		p->next = pools;
+		pools = p;
+	} else if (p->pid != getpid()) {
+		/* we were forked: those sockets belong to our parent, forget them */
+		p->idle = NULL;
+		p->total = 0;
+		p->normal = 0;
+		p->waiting_priority = 0;
+		p->pid = getpid();
+	}
+	return p;
+}
+
 /* private: open connection to PostgreSQL */
+static PGconn *
+db_open(const char *connstr)
+{
+	PGconn *conn;
+
+	conn = PQconnectdb(connstr);
+	if(PQstatus(conn) != CONNECTION_OK) {
+		SYSLOG("PostgreSQL connection failed: '%s'", PQerrorMessage(conn));
+		PQfinish(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/* private: may this caller take a connection now?  called with pool_lock held */
+static int
+pool_admit(modopt_t *options, struct pool *p)
+{
+	int limit;
+
+	if (options->priority)
+		return 1;
+	limit = options->pool_size - options->pool_reserved;
+	if (options->priority_claimed)
+		limit += options->pool_reserved / 2;
+	return p->waiting_priority == 0 && p->normal < limit;
+}
+
+/* private: wait for a connection to be released, 0 once the caller's deadline passed */
+static int
+pool_wait(modopt_t *options, struct pool *p, const struct timespec *deadline)
+{
+	int rc;
+
+	if (options->priority)
+		p->waiting_priority++;
+	rc = pthread_cond_timedwait(&p->cond, &pool_lock, deadline);
+	if (options->priority)
+		p->waiting_priority--;
+	return rc != ETIMEDOUT;
+}
+
+/* private: check a connection out of the pool, *role is what it was left in */
+static PGconn *
+pool_get(modopt_t *options, char **role)
+{
+	struct pool *p;
+	struct pool_conn *pc;
+	struct timespec deadline;
+	PGconn *conn = NULL;
+	int wait;
+
+	*role = NULL;
+	if (options->pool_size <= 0)
+		return db_open(options->connstr);
+
+	wait = options->admission_timeout;
+	if (options->priority || wait <= 0 || wait > POOL_WAIT_MAX)
+		wait = POOL_WAIT_MAX;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += wait / 1000;
+	deadline.tv_nsec += (wait % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	p = pool_find(options->connstr);
+	for (;;) {
+		if (pool_admit(options, p) && (pc = p->idle) != NULL) {
+			p->idle = pc->next;
+			conn = pc->conn;
+			*role = pc->role;
+			if (options->pool_idle_timeout > 0 &&
+			    time(NULL) - pc->last_used > options->pool_idle_timeout) {
+				PQfinish(conn);
+				free(*role);
+				*role = NULL;
+				conn = NULL;
+				p->total--;
+			}
+			free(pc);
+			if (conn != NULL) {
+				if (!options->priority)
+					p->normal++;
+				break;
+			}
+		} else if (pool_admit(options, p) && p->total < options->pool_size) {
+			p->total++;
+			if (!options->priority)
+				p->normal++;
+			pthread_mutex_unlock(&pool_lock);
+			if ((conn = db_open(options->connstr)) != NULL)
+				return conn;
+			pthread_mutex_lock(&pool_lock);
+			p->total--;
+			if (!options->priority)
+				p->normal--;
+			pthread_cond_broadcast(&p->cond);
+			break;
+		} else if (!pool_wait(options, p, &deadline)) {
+			SYSLOG("no database connection free within %d ms, request shed", wait);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return conn;
+}
+
+/* private: close a checked out connection for good */
+static void
+pool_drop(modopt_t *options, PGconn *conn)
+{
+	struct pool *p;
+
+	PQfinish(conn);
+	if (options->pool_size <= 0)
+		return;
+	pthread_mutex_lock(&pool_lock);
+	p = pool_find(options->connstr);
+	p->total--;
+	if (!options->priority)
+		p->normal--;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* private: put the session into the configured role, current is the one it is in */
+static int
+db_set_role(modopt_t *options, PGconn *conn, const char *current)
+{
+	PGresult *res;
+	char *ident, *command;
+	int rc;
+
+	if (options->role == NULL ? current == NULL : (current != NULL && !strcmp(current, options->role)))
+		return PAM_SUCCESS;
+
+	if (options->role == NULL) {
+		res = PQexec(conn, "RESET ROLE");
+	} else {
+		if ((ident = PQescapeIdentifier(conn, options->role, strlen(options->role))) == NULL)
+			return PAM_BUF_ERR;
+		command = malloc(strlen(ident) + 10);
+		sprintf(command, "SET ROLE %s", ident);
+		PQfreemem(ident);
+		res = PQexec(conn, command);
+		free(command);
+	}
+
+	rc = result_check(res);
+	PQclear(res);
+	return rc;
+}
+
+/* get a connection, from the pool when enabled */
 PGconn *
 db_connect(modopt_t *options)
 {
 	PGconn *conn;
+	char *role;
+	int span;
+
 	if(options->connstr == NULL)
 		options->connstr = build_conninfo(options);
 
-	conn = PQconnectdb(options->connstr);
-	if(PQstatus(conn) != CONNECTION_OK) {
-		SYSLOG("PostgreSQL connection failed: '%s'", PQerrorMessage(conn));
+	span = trace_span(options, "connect");
+	if (!(conn = pool_get(options, &role))) {
+		trace_end_rc(options, span, PAM_AUTHINFO_UNAVAIL);
 		return NULL;
 	}
+
+	/*
+	 * A pooled session the server closed while it sat idle is reopened
+	 * before anything is sent.  The new session starts out in the login
+	 * role, whatever role the old one was left in.
+	 */
+	if (options->pool_size > 0 && (!PQconsumeInput(conn) || PQstatus(conn) == CONNECTION_BAD)) {
+		DBGLOG("pooled session went away, reconnecting");
+		PQreset(conn);
+		free(role);
+		role = NULL;
+		if (PQstatus(conn) != CONNECTION_OK) {
+			SYSLOG("PostgreSQL connection failed: '%s'", PQerrorMessage(conn));
+			pool_drop(options, conn);
+			trace_end_rc(options, span, PAM_AUTHINFO_UNAVAIL);
+			return NULL;
+		}
+	}
+	trace_attr(options, span, "server.address", PQhost(conn));
+	trace_attr(options, span, "db.tls", PQsslInUse(conn) ? "yes" : "no");
+
+	if (db_set_role(options, conn, role) != PAM_SUCCESS) {
+		SYSLOG("could not switch to role %s", options->role ? options->role : "(default)");
+		pool_drop(options, conn);
+		conn = NULL;
+	}
+	free(role);
+	trace_end_rc(options, span, conn ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL);
 	return conn;
 }
 
+/* give a connection obtained with db_connect() back */
+void
+db_release(modopt_t *options, PGconn *conn)
+{
+	struct pool *p;
+	struct pool_conn *pc;
+
+	if (conn == NULL)
+		return;
+
+	if (options->pool_size <= 0) {
+		PQfinish(conn);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	p = pool_find(options->connstr);
+	if (PQstatus(conn) != CONNECTION_OK || PQtransactionStatus(conn) != PQTRANS_IDLE) {
+		/* don't hand a broken or busy session to the next caller */
+		PQfinish(conn);
+		p->total--;
+	} else {
+		pc = malloc(sizeof(struct pool_conn));
+		pc->conn = conn;
+		pc->role = options->role ? strdup(options->role) : NULL;
+		pc->last_used = time(NULL);
+		pc->next = p->idle;
+		p->idle = pc;
+	}
+	if (!options->priority)
+		p->normal--;
+	/* waiters differ in what they may take, wake them all to recheck */
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* private: does the query reference the given placeholder? */
+static int
+query_uses(const char *query, char c)
+{
+	const char *p;
+
+	for (p = query; p && *p; p++) {
+		if (*p == '%') {
+			if (p[1] == c)
+				return 1;
+			if (p[1] == '%')
+				p++;
+		}
+	}
+	return 0;
+}
+
 /* private: expand query; partially stolen from mailutils */
 
 static int
-expand_query (char **command, const char** values, const char *query, const char *service, const char *user, const char *passwd, const char *rhost, const char *raddr)
+expand_query (char **command, const char** values, const char *query, const char *service, const char *user, const char *passwd, const char *rhost, const char *raddr, const char *network)
 {
 	char *p, *q, *res;
 	unsigned int len;
@@ -111,7 +487,7 @@ expand_query (char **command, const char** values, const char *query, const char
 	/* Compute resulting query length */
 	for (len = 0, p = (char *) query; *p; ) {
 		if (*p == '%') {
-			if (p[1] == 'u' || p[1] == 'p' || p[1] == 's') {
+			if (p[1] == 'u' || p[1] == 'p' || p[1] == 's' || p[1] == 'h' || p[1] == 'i' || p[1] == 'n') {
 				len += 4; /*we allow 128 tokens max*/
 				p += 2;
 				continue;
@@ -166,7 +542,7 @@ expand_query (char **command, const char** values, const char *query, const char
 					q += strlen (q);
 					p++;
 					if (!raddr) {
-						if (strchr(rhost, '.') != NULL) {
+						if (rhost != NULL && strchr(rhost, '.') != NULL) {
 							*command = NULL;
 							free (res);
 							return 0;
@@ -174,6 +550,13 @@ expand_query (char **command, const char** values, const char *query, const char
 					}
 				}
 				break;
+				case 'n': {
+					sprintf(q, "$%i", ++nparm);
+					values[nparm-1] = network;
+					q += strlen (q);
+					p++;
+				}
+				break;
 				case '%':
 				default:
 					*q++ = *p++;
@@ -188,41 +571,556 @@ expand_query (char **command, const char** values, const char *query, const char
 	 return nparm;
 }
 
-/* private: execute query */
+/* expand the placeholders of query into q, see query_free() */
 int
-pg_execParam(PGconn *conn, PGresult **res, 
+query_prepare(modopt_t *options, struct pg_query *q,
         const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
 {
-	int nparm = 0;
-	const char *values[128];
-	char *command, *raddr;
-	struct hostent *hentry;
+	const char *network;
+	char *traced;
 
-	if (!conn) 
-		return PAM_AUTHINFO_UNAVAIL;
-	bzero(values, sizeof(*values));
+	bzero(q, sizeof(*q));
 	
-	raddr = NULL;
+	/* only pay for a lookup when %i or %n is actually used */
+	network = NULL;
+	if (query_uses(query, 'i') || query_uses(query, 'n'))
+		q->raddr = resolve_rhost(options, rhost);
+	if (query_uses(query, 'n') && (q->networks = cidr_table_get(options->network_file)) != NULL)
+		network = cidr_lookup(q->networks, q->raddr);
 	
-	if(rhost != NULL && (hentry = gethostbyname(rhost)) != NULL) {
-		/* Make IP string */
-		raddr = malloc(INET_ADDRSTRLEN);
-		inet_ntop(AF_INET, hentry->h_addr_list[0], raddr, INET_ADDRSTRLEN);
+	q->nparm = expand_query(&q->command, q->values, query, service, user, passwd, rhost, q->raddr, network);
+	if (q->command == NULL) {
+		cidr_table_put(q->networks);
+		free (q->raddr);
+		return PAM_AUTH_ERR;
 	}
-	
-	nparm = expand_query(&command, values, query, service, user, passwd, rhost, raddr);
-	if (command == NULL) 
+
+	/* let the server logs show which trace a statement belongs to */
+	if (*trace_comment(options)) {
+		traced = malloc(strlen(trace_comment(options)) + strlen(q->command) + 1);
+		sprintf(traced, "%s%s", trace_comment(options), q->command);
+		free(q->command);
+		q->command = traced;
+	}
+	return PAM_SUCCESS;
+}
+
+void
+query_free(struct pg_query *q)
+{
+	cidr_table_put(q->networks);
+	free (q->command);
+	free (q->raddr);
+}
+
+/* private: the option a query came from, for traces */
+static const char *
+query_name(modopt_t *options, const char *query)
+{
+	if (query == options->query_auth)
+		return "auth_query";
+	if (query == options->query_acct)
+		return "acct_query";
+	if (query == options->query_pwd)
+		return "pwd_query";
+	if (query == options->query_auth_succ)
+		return "auth_succ_query";
+	if (query == options->query_auth_fail)
+		return "auth_fail_query";
+	if (query == options->query_session_open)
+		return "session_open_query";
+	if (query == options->query_session_close)
+		return "session_close_query";
+	if (query == options->history_query)
+		return "history_query";
+	if (query == options->history_update_query)
+		return "history_update_query";
+	return "query";
+}
+
+/* private: execute query */
+int
+pg_execParam(modopt_t *options, PGconn *conn, PGresult **res,
+        const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	struct pg_query q;
+	int span, rc;
+
+	if (!conn) 
+		return PAM_AUTHINFO_UNAVAIL;
+	span = trace_span(options, query_name(options, query));
+	if (query_prepare(options, &q, query, service, user, passwd, rhost) != PAM_SUCCESS) {
+		trace_end_rc(options, span, PAM_AUTH_ERR);
 		return PAM_AUTH_ERR;
-	
-	*res = PQexecParams(conn, command, nparm, 0, values, 0, 0, 0);
-	free (command);
-	free (raddr);
+	}
+
+	*res = PQexecParams(conn, q.command, q.nparm, 0, q.values, 0, 0, 0);
+	query_free(&q);
     
-	if(PQresultStatus(*res) != PGRES_COMMAND_OK && PQresultStatus(*res) != PGRES_TUPLES_OK) {
-		SYSLOG("PostgreSQL query failed: '%s'", PQresultErrorMessage(*res));
+	rc = result_check(*res);
+	trace_attr(options, span, "server.address", PQhost(conn));
+	trace_attr_int(options, span, "db.rows", PQntuples(*res));
+	trace_end_rc(options, span, rc);
+	return rc;
+}
+
+/*
+ * Single-flight lookups.  When the same read-only query with the same
+ * parameters is already running in another thread, wait for its result
+ * instead of sending it again; every waiter gets its own copy.  Queries
+ * using %p are never shared, their result depends on the password.
+ */
+struct flight {
+	char *key;
+	int waiters;
+	int done;
+	int rc;
+	PGresult *res;
+	struct flight *next;
+};
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond = PTHREAD_COND_INITIALIZER;
+static struct flight *flights = NULL;
+
+/*
+ * Hedged reads.  A read that takes longer than hedge_percentile of the
+ * recently observed read latencies is sent to a second replica as well;
+ * whichever answers first wins and the other one is cancelled.  At most
+ * hedge_max_rate percent of the reads are hedged, so a slow cluster
+ * isn't hit twice as hard.
+ *
+ * The latencies are kept per process and nothing is hedged before
+ * HEDGE_MIN_SAMPLES reads were seen, so this only ever kicks in within
+ * long running (threaded) hosts, never where every login forks a new
+ * process.
+ */
+#define HEDGE_SAMPLES       256
+#define HEDGE_MIN_SAMPLES   32
+
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+static long hedge_latency[HEDGE_SAMPLES];
+static unsigned int hedge_nsamples = 0;
+static unsigned int hedge_reads = 0, hedge_sent = 0;
+
+static long
+elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int
+cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* private: ms to wait before hedging, -1 if there isn't enough history yet */
+static long
+hedge_delay(modopt_t *options)
+{
+	long sorted[HEDGE_SAMPLES];
+	unsigned int n;
+
+	pthread_mutex_lock(&hedge_lock);
+	n = hedge_nsamples < HEDGE_SAMPLES ? hedge_nsamples : HEDGE_SAMPLES;
+	memcpy(sorted, hedge_latency, n * sizeof(long));
+	pthread_mutex_unlock(&hedge_lock);
+
+	if (n < HEDGE_MIN_SAMPLES)
+		return -1;
+	qsort(sorted, n, sizeof(long), cmp_long);
+	return sorted[(n - 1) * options->hedge_percentile / 100];
+}
+
+static void
+hedge_record(long ms, int hedged)
+{
+	pthread_mutex_lock(&hedge_lock);
+	hedge_latency[hedge_nsamples++ % HEDGE_SAMPLES] = ms;
+	/* keep the rate about recent reads */
+	if (++hedge_reads > 1000) {
+		hedge_reads /= 2;
+		hedge_sent /= 2;
+	}
+	if (hedged)
+		hedge_sent++;
+	pthread_mutex_unlock(&hedge_lock);
+}
+
+static int
+hedge_allowed(modopt_t *options)
+{
+	int ok;
+
+	pthread_mutex_lock(&hedge_lock);
+	ok = (hedge_sent + 1) * 100 <= (hedge_reads + 1) * options->hedge_max_rate;
+	pthread_mutex_unlock(&hedge_lock);
+	return ok;
+}
+
+/* private: connect to connstr instead of the configured one */
+static PGconn *
+db_connect_to(modopt_t *options, const char *connstr)
+{
+	PGconn *conn;
+	char *saved;
+
+	saved = options->connstr;
+	options->connstr = (char *) connstr;
+	conn = db_connect(options);
+	options->connstr = saved;
+	return conn;
+}
+
+static void
+db_release_to(modopt_t *options, const char *connstr, PGconn *conn)
+{
+	char *saved;
+
+	saved = options->connstr;
+	options->connstr = (char *) connstr;
+	db_release(options, conn);
+	options->connstr = saved;
+}
+
+/* private: throw away the rest of a finished query's results */
+static void
+db_drain(PGconn *conn)
+{
+	PGresult *r;
+
+	while ((r = PQgetResult(conn)) != NULL)
+		PQclear(r);
+}
+
+/*
+ * private: ask the server to stop the query running on conn, without
+ * waiting for it; db_release() closes the still busy session
+ */
+static void
+db_cancel(PGconn *conn)
+{
+	PGcancel *c;
+	char err[256];
+
+	if ((c = PQgetCancel(conn)) != NULL) {
+		PQcancel(c, err, sizeof(err));
+		PQfreeCancel(c);
+	}
+}
+
+/* private: read on the current connection, hedged to the hedge replica */
+static int
+pg_execHedged(modopt_t *options, const char *hedge, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	struct pg_query q;
+	struct timespec start;
+	struct pollfd pfd[2];
+	const char *connstr[2];
+	PGconn *conn[2] = { NULL, NULL };
+	PGresult *r;
+	int active[2] = { 0, 0 };
+	long delay;
+	int i, rc, timeout, winner = -1, span;
+
+	*res = NULL;
+	if (query_prepare(options, &q, query, service, user, passwd, rhost) != PAM_SUCCESS)
+		return PAM_AUTH_ERR;
+
+	connstr[0] = options->connstr;
+	connstr[1] = hedge;
+	if (!(conn[0] = db_connect(options))) {
+		query_free(&q);
 		return PAM_AUTHINFO_UNAVAIL;
 	}
-	return PAM_SUCCESS;
+	span = trace_span(options, query_name(options, query));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	delay = hedge_delay(options);
+	if (!(active[0] = PQsendQueryParams(conn[0], q.command, q.nparm, 0, q.values, 0, 0, 0)))
+		SYSLOG("PostgreSQL query failed: '%s'", PQerrorMessage(conn[0]));
+
+	while ((active[0] || active[1]) && winner < 0) {
+		timeout = -1;
+		if (conn[1] == NULL && delay >= 0)
+			timeout = delay > elapsed_ms(&start) ? delay - elapsed_ms(&start) : 0;
+
+		for (i = 0; i < 2; i++) {
+			pfd[i].fd = active[i] ? PQsocket(conn[i]) : -1;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, 2, timeout) == 0) {
+			/* too slow: ask the second replica too, if we still may */
+			delay = -1;
+			if (hedge_allowed(options) && (conn[1] = db_connect_to(options, hedge)) != NULL) {
+				DBGLOG("hedging read to second replica after %ldms", elapsed_ms(&start));
+				trace_attr_int(options, span, "hedge.after_ms", elapsed_ms(&start));
+				active[1] = PQsendQueryParams(conn[1], q.command, q.nparm, 0, q.values, 0, 0, 0);
+			}
+			continue;
+		}
+
+		for (i = 0; i < 2 && winner < 0; i++) {
+			if (!active[i] || !(pfd[i].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			if (!PQconsumeInput(conn[i])) {
+				active[i] = 0;	/* the other one may still make it */
+				continue;
+			}
+			if (PQisBusy(conn[i]))
+				continue;
+			/* an error is only the answer if the other one fails too */
+			r = PQgetResult(conn[i]);
+			db_drain(conn[i]);
+			active[i] = 0;
+			PQclear(*res);
+			*res = r;
+			if (PQresultStatus(r) == PGRES_TUPLES_OK || PQresultStatus(r) == PGRES_COMMAND_OK)
+				winner = i;
+		}
+	}
+
+	if (winner >= 0) {
+		if (active[1 - winner])
+			db_cancel(conn[1 - winner]);
+		hedge_record(elapsed_ms(&start), conn[1] != NULL);
+		trace_attr(options, span, "server.address", PQhost(conn[winner]));
+	}
+	query_free(&q);
+
+	for (i = 0; i < 2; i++)
+		if (conn[i] != NULL)
+			db_release_to(options, connstr[i], conn[i]);
+
+	rc = *res ? result_check(*res) : PAM_AUTHINFO_UNAVAIL;
+	if (rc != PAM_SUCCESS) {
+		PQclear(*res);
+		*res = NULL;
+	}
+	trace_end_rc(options, span, rc);
+	return rc;
+}
+
+/* private: execute on a connection of our own */
+static int
+pg_execSingle(modopt_t *options, const char *hedge, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	PGconn *conn;
+	int rc;
+
+	if (hedge != NULL)
+		return pg_execHedged(options, hedge, res, query, service, user, passwd, rhost);
+
+	*res = NULL;
+	if (!(conn = db_connect(options)))
+		return PAM_AUTHINFO_UNAVAIL;
+	if ((rc = pg_execParam(options, conn, res, query, service, user, passwd, rhost)) != PAM_SUCCESS) {
+		PQclear(*res);
+		*res = NULL;
+	}
+	db_release(options, conn);
+	return rc;
+}
+
+/*
+ * private: everything the result depends on, except the password.  The
+ * connection string is the server actually asked (backend, shard or
+ * replica); the role matters as pooled sessions are shared between roles.
+ */
+static char *
+flight_key(modopt_t *options, const char *query, const char *service, const char *user, const char *rhost)
+{
+	const char *parts[8];
+	char shard[16];
+	size_t len = 0;
+	char *key, *q;
+	int i;
+
+	snprintf(shard, sizeof(shard), "%d", options->nshards > 0 ? options->shard : -1);
+	parts[0] = options->connstr; parts[1] = options->role; parts[2] = options->backend_name;
+	parts[3] = shard; parts[4] = query; parts[5] = service; parts[6] = user; parts[7] = rhost;
+	for (i = 0; i < 8; i++)
+		len += (parts[i] ? strlen(parts[i]) : 0) + 2;
+
+	q = key = malloc(len + 1);
+	for (i = 0; i < 8; i++) {
+		/* keep NULL apart from the empty string */
+		*q++ = parts[i] ? '+' : '-';
+		if (parts[i]) {
+			strcpy(q, parts[i]);
+			q += strlen(parts[i]);
+		}
+		*q++ = '\x1f';
+	}
+	*q = '\0';
+	return key;
+}
+
+/* private: a lookup, shared with identical concurrent ones if enabled */
+static int
+pg_execFlight(modopt_t *options, const char *hedge, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	struct flight *f, **pf;
+	char *key;
+	int rc;
+
+	if (!options->coalesce_queries || query_uses(query, 'p'))
+		return pg_execSingle(options, hedge, res, query, service, user, passwd, rhost);
+
+	if(options->connstr == NULL)
+		options->connstr = build_conninfo(options);
+	key = flight_key(options, query, service, user, rhost);
+
+	pthread_mutex_lock(&flight_lock);
+	for (f = flights; f != NULL; f = f->next)
+		if (!f->done && !strcmp(f->key, key))
+			break;
+
+	if (f != NULL) {
+		/* somebody is already asking, wait for the answer */
+		f->waiters++;
+		while (!f->done)
+			pthread_cond_wait(&flight_cond, &flight_lock);
+		rc = f->rc;
+		*res = f->res ? PQcopyResult(f->res, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES) : NULL;
+		if (--f->waiters == 0) {
+			PQclear(f->res);
+			free(f->key);
+			free(f);
+		}
+		pthread_mutex_unlock(&flight_lock);
+		free(key);
+		return (rc == PAM_SUCCESS && *res == NULL) ? PAM_BUF_ERR : rc;
+	}
+
+	f = calloc(1, sizeof(struct flight));
+	f->key = key;
+	f->next = flights;
+	flights = f;
+	pthread_mutex_unlock(&flight_lock);
+
+	rc = pg_execSingle(options, hedge, res, query, service, user, passwd, rhost);
+
+	pthread_mutex_lock(&flight_lock);
+	for (pf = &flights; *pf != f; pf = &(*pf)->next);
+	*pf = f->next;
+	f->done = 1;
+	f->rc = rc;
+	if (f->waiters > 0) {
+		/* the last waiter cleans up */
+		f->res = *res ? PQcopyResult(*res, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES) : NULL;
+		pthread_cond_broadcast(&flight_cond);
+	} else {
+		free(f->key);
+		free(f);
+	}
+	pthread_mutex_unlock(&flight_lock);
+
+	return rc;
+}
+
+/* execute a lookup, sharing it with identical concurrent ones if enabled */
+int
+pg_execShared(modopt_t *options, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	return pg_execFlight(options, NULL, res, query, service, user, passwd, rhost);
+}
+
+/* private: send a read to a replica when that is safe, else to the primary */
+static int
+pg_execRead(modopt_t *options, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	const char *replica, *hedge;
+	char *primary;
+	int rc;
+
+	/* replicas belong to the primary, not to the shards */
+	if (options->nshards > 0 || (replica = replica_choose(options, user, NULL)) == NULL)
+		return pg_execShared(options, res, query, service, user, passwd, rhost);
+
+	hedge = NULL;
+	if (options->hedge_percentile > 0)
+		hedge = replica_choose(options, user, replica);
+
+	if(options->connstr == NULL)
+		options->connstr = build_conninfo(options);
+	primary = options->connstr;
+	options->connstr = (char *) replica;
+	rc = pg_execFlight(options, hedge, res, query, service, user, passwd, rhost);
+	options->connstr = primary;
+	if (rc == PAM_SUCCESS)
+		return rc;
+
+	replica_failed(options, replica);
+	return pg_execShared(options, res, query, service, user, passwd, rhost);
+}
+
+/*
+ * Lookup by user.  While a reshard is in progress (shard_previous set)
+ * a user that isn't found on its new shard is looked up on the shard it
+ * lived on before; if found there, the rest of this call talks to that
+ * shard too.
+ */
+int
+pg_execLookup(modopt_t *options, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	PGresult *old_res;
+	char *connstr;
+	int rc, old;
+
+	rc = pg_execRead(options, res, query, service, user, passwd, rhost);
+	if (rc != PAM_SUCCESS || PQntuples(*res) > 0 ||
+	    options->nshards == 0 || options->shard_previous <= 0 || user == NULL)
+		return rc;
+
+	old = mod_options_shard(user, options->shard_previous);
+	if (old == options->shard || old >= options->nshards)
+		return rc;
+
+	DBGLOG("user %s not on shard %d yet, trying shard %d", user, options->shard, old);
+	connstr = options->connstr;
+	options->connstr = strdup(options->shards[old]);
+	if (pg_execShared(options, &old_res, query, service, user, passwd, rhost) == PAM_SUCCESS &&
+	    PQntuples(old_res) > 0) {
+		PQclear(*res);
+		*res = old_res;
+		options->shard = old;
+		free(connstr);
+		return PAM_SUCCESS;
+	}
+	if (old_res)
+		PQclear(old_res);
+	free(options->connstr);
+	options->connstr = connstr;
+	return rc;
+}
+
+/*
+ * Before writing for a user without having looked the user up first
+ * (root changing a password, the session queries), find the shard the
+ * user is on right now: while resharding it may still be the old one.
+ * acct_query is used for this if set, auth_query otherwise.
+ */
+void
+pg_locateUser(modopt_t *options, const char *service, const char *user, const char *rhost)
+{
+	PGresult *res = NULL;
+	const char *query;
+
+	if (options->nshards == 0 || options->shard_previous <= 0 || user == NULL)
+		return;
+	if ((query = options->query_acct ? options->query_acct : options->query_auth) == NULL)
+		return;
+	pg_execLookup(options, &res, query, service, user, NULL, rhost);
+	if (res)
+		PQclear(res);
 }
 
 /* private: convert an integer to a radix 64 character */
@@ -242,48 +1140,207 @@ i64c(int i)
 	return ('z');
 }
 
+/*
+ * check the client address against allow_from / deny_from, no db involved.
+ * Only numeric addresses are filtered: a host name comes from the
+ * client's reverse DNS, which the client controls, so it is never
+ * resolved here and counts as not being in any list.
+ */
+int
+backend_client_allowed(modopt_t *options, const char *rhost)
+{
+	cidr_table_t *table;
+	unsigned char buf[sizeof(struct in6_addr)];
+	const char *raddr;
+	int rc = PAM_SUCCESS, span;
+
+	if ((options->allow_from == NULL && options->deny_from == NULL) ||
+	    rhost == NULL || *rhost == '\0')
+		return PAM_SUCCESS;
+
+	span = trace_span(options, "address_filter");
+	raddr = (inet_pton(AF_INET, rhost, buf) == 1 || inet_pton(AF_INET6, rhost, buf) == 1) ? rhost : NULL;
+
+	if (options->deny_from) {
+		if ((table = cidr_table_get(options->deny_from)) == NULL) {
+			SYSLOG("can't read deny_from file %s, not denying anybody", options->deny_from);
+		} else {
+			if (raddr != NULL && cidr_lookup(table, raddr) != NULL)
+				rc = PAM_AUTH_ERR;
+			cidr_table_put(table);
+		}
+	}
+	if (rc == PAM_SUCCESS && options->allow_from) {
+		/* an allow list we can't read lets nobody in, nor does it let in names */
+		if ((table = cidr_table_get(options->allow_from)) == NULL) {
+			SYSLOG("can't read allow_from file %s, not allowing anybody", options->allow_from);
+			rc = PAM_AUTH_ERR;
+		} else {
+			if (raddr == NULL || cidr_lookup(table, raddr) == NULL)
+				rc = PAM_AUTH_ERR;
+			cidr_table_put(table);
+		}
+	}
+
+	if (rc != PAM_SUCCESS)
+		SYSLOG("client %s rejected by address filter%s", rhost, raddr ? "" : " (not a numeric address)");
+	trace_end_rc(options, span, rc);
+	return rc;
+}
+
 /* authenticate user and passwd against database */
 int
 backend_authenticate(const char *service, const char *user, const char *passwd, const char *rhost, modopt_t *options)
 {
 	PGresult *res;
-	PGconn *conn;
-	int rc, row_count;
-	char *tmp;
+	int rc;
 
-	if (!(conn = db_connect(options)))
+	/* a function's result is the verdict itself, there is nothing to save after the query */
+	if (options->pw_type == PW_FUNCTION && badpass_seen(options, user, passwd, NULL)) {
+		DBGLOG("password of %s was wrong a moment ago already", user);
+		trace_attr(options, 0, "pam.wrong_password_cache", "hit");
 		return PAM_AUTH_ERR;
+	}
 
 	DBGLOG("query: %s", options->query_auth);
 	rc = PAM_AUTH_ERR;	
-	if (pg_execParam(conn, &res, options->query_auth, service, user, passwd, rhost) == PAM_SUCCESS) {
-		row_count = PQntuples(res);
-		if (row_count == 0) {
-			rc = PAM_USER_UNKNOWN;
+	if (pg_execLookup(options, &res, options->query_auth, service, user, passwd, rhost) == PAM_SUCCESS) {
+		if (options->pw_type != PW_FUNCTION && badpass_seen(options, user, passwd, res)) {
+			/* wrong against these very stored passwords a moment ago, don't hash again */
+			DBGLOG("password of %s was wrong a moment ago already", user);
+			trace_attr(options, 0, "pam.wrong_password_cache", "hit");
 		} else {
-			for (int i = 0; i < row_count && rc != PAM_SUCCESS; i++) {
-				if (!PQgetisnull(res, i, 0)) {
-					char *stored_pw = PQgetvalue(res, i, 0);
-					if (options->pw_type == PW_FUNCTION) {
-						if (!strcmp(stored_pw, "t")) {
-							rc = PAM_SUCCESS;
-						}
-					} else {
-						tmp = password_encrypt(options, user, passwd, stored_pw);
-						if (tmp != NULL && !strcmp(stored_pw, tmp)) {
-							rc = PAM_SUCCESS;
-						}
-						free (tmp);
+			rc = backend_verify(options, user, passwd, res);
+			if (rc == PAM_SUCCESS || rc == PAM_AUTH_ERR)
+				badpass_record(options, user, passwd, res, rc);
+		}
+		PQclear(res);
+	}
+	return rc;
+}
+
+/* check passwd against the stored passwords returned by auth_query */
+int
+backend_verify(modopt_t *options, const char *user, const char *passwd, PGresult *res)
+{
+	int rc, row_count, span;
+	char *tmp;
+
+	rc = PAM_AUTH_ERR;
+	span = trace_span(options, "verify");
+	row_count = PQntuples(res);
+	if (row_count == 0) {
+		rc = PAM_USER_UNKNOWN;
+	} else {
+		for (int i = 0; i < row_count && rc != PAM_SUCCESS; i++) {
+			if (!PQgetisnull(res, i, 0)) {
+				char *stored_pw = PQgetvalue(res, i, 0);
+				if (options->pw_type == PW_FUNCTION) {
+					if (!strcmp(stored_pw, "t")) {
+						rc = PAM_SUCCESS;
+					}
+				} else {
+					tmp = password_encrypt(options, user, passwd, stored_pw);
+					if (tmp != NULL && !strcmp(stored_pw, tmp)) {
+						rc = PAM_SUCCESS;
 					}
+					free (tmp);
 				}
 			}
 		}
-		PQclear(res);
 	}
-	PQfinish(conn);
+	trace_end_rc(options, span, rc);
 	return rc;
 }
 
+/* private: crypt() into an allocated string */
+static char *
+crypt_hash(const char *pass, const char *salt)
+{
+	char *c, *s = NULL;
+
+#if HAVE_CRYPT_R
+	/* reentrant, the password history is checked by several threads */
+	struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+	if (data != NULL) {
+		if ((c = crypt_r(pass, salt, data)) != NULL) {
+			s = strdup(c);
+		}
+		free(data);
+	}
+#else
+	pthread_mutex_lock(&crypt_lock);
+	if ((c = crypt(pass, salt)) != NULL) {
+		s = strdup(c);
+	}
+	pthread_mutex_unlock(&crypt_lock);
+#endif
+	return s;
+}
+
+/* private: measure the rounds that make one crypt_sha512 take about target_ms */
+static int
+crypt_bench(modopt_t *options, int target_ms)
+{
+	struct timespec start, end;
+	double ms, best = 0;
+	char salt[32], *s;
+	int i, rounds;
+
+	/* the fastest of a few runs, the others were disturbed */
+	snprintf(salt, sizeof(salt), "$6$rounds=%d$pgsqlbnc", HASH_BENCH_ROUNDS);
+	for (i = 0; i < 3; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		s = crypt_hash("benchmark", salt);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		free(s);
+		ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+		if (i == 0 || ms < best)
+			best = ms;
+	}
+	if (best <= 0)
+		best = 0.001;
+	ms = HASH_BENCH_ROUNDS * target_ms / best;
+	rounds = ms < HASH_MIN_ROUNDS ? HASH_MIN_ROUNDS : ms > HASH_MAX_ROUNDS ? HASH_MAX_ROUNDS : (int) ms;
+	DBGLOG("%d rounds of crypt_sha512 take %.3f ms, using %d rounds for %d ms",
+	    HASH_BENCH_ROUNDS, best, rounds, target_ms);
+	return rounds;
+}
+
+/* private: rounds that make one crypt_sha512 take about target_hash_ms, 0 for the default */
+static int
+crypt_rounds(modopt_t *options)
+{
+	struct hash_tune *t;
+	time_t now = time(NULL);
+	int rounds, current, measure;
+
+	if (options->target_hash_ms <= 0 || options->pw_type != PW_CRYPT_SHA512)
+		return 0;
+
+	pthread_mutex_lock(&hash_tune_lock);
+	if (hash_tune == NULL && (hash_tune = shm_attach(HASH_TUNE_SHM, sizeof(struct hash_tune))) == NULL)
+		hash_tune = &hash_tune_local;
+	t = hash_tune;
+	pthread_mutex_unlock(&hash_tune_lock);
+
+	shm_lock(&t->lock);
+	current = t->rounds != 0 && t->target_ms == options->target_hash_ms;
+	rounds = current ? t->rounds : 0;
+	if ((measure = !current || now - t->tuned >= HASH_TUNE_INTERVAL))
+		t->tuned = now;
+	shm_unlock(&t->lock);
+
+	if (measure) {
+		rounds = crypt_bench(options, options->target_hash_ms);
+		shm_lock(&t->lock);
+		t->rounds = rounds;
+		t->target_ms = options->target_hash_ms;
+		shm_unlock(&t->lock);
+	}
+	return rounds;
+}
+
 /* private: encrypt password using the preferred encryption scheme */
 char *
 password_encrypt(modopt_t *options, const char *user, const char *pass, const char *salt)
@@ -294,15 +1351,10 @@ password_encrypt(modopt_t *options, const char *user, const char *pass, const ch
 		case PW_CRYPT:
 		case PW_CRYPT_MD5:
 		case PW_CRYPT_SHA512: {
-			char *c = NULL;
 			if (salt==NULL) {
-				c = crypt(pass, crypt_makesalt(options->pw_type));
-			} else {
-				c = crypt(pass, salt);
-			}
-			if (c!=NULL) {
-				s = strdup(c);
+				salt = crypt_makesalt(options->pw_type, crypt_rounds(options));
 			}
+			s = crypt_hash(pass, salt);
 		}
 		break;
 		case PW_MD5: {
@@ -361,9 +1413,9 @@ password_encrypt(modopt_t *options, const char *user, const char *pass, const ch
 }
 
 static char *
-crypt_makesalt(pw_scheme scheme)
+crypt_makesalt(pw_scheme scheme, int rounds)
 {
-	static char result[12];
+	static char result[40];
 	int len,pos;
 	struct timeval now;
 
@@ -371,9 +1423,13 @@ crypt_makesalt(pw_scheme scheme)
 		len=2;
 		pos=0;
 	} else if(scheme==PW_CRYPT_SHA512) { /* PW_CRYPT_SHA512 */
-		strcpy (result, "$6$");
-		len = 11;
-		pos = 3;
+		if (rounds > 0) {
+			pos = sprintf(result, "$6$rounds=%d$", rounds);
+		} else {
+			strcpy (result, "$6$");
+			pos = 3;
+		}
+		len = pos + 8;
 	} else { /* PW_CRYPT_MD5 */
 		strcpy(result,"$1$");
 		len=11;
@@ -5,8 +5,26 @@
 #include <security/pam_modules.h>
 #include "pam_pgsql_options.h"
 
+/* a query with its placeholders expanded, ready to be sent */
+struct pg_query {
+	char *command;
+	const char *values[128];
+	int nparm;
+	char *raddr;
+	struct cidr_table_s *networks;
+};
+
+const char * db_connstr(modopt_t *options);
 PGconn * db_connect(modopt_t *options);
-int pg_execParam(PGconn *conn, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost);
+void db_release(modopt_t *options, PGconn *conn);
+int query_prepare(modopt_t *options, struct pg_query *q, const char *query, const char *service, const char *user, const char *passwd, const char *rhost);
+void query_free(struct pg_query *q);
+int pg_execParam(modopt_t *options, PGconn *conn, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost);
+int pg_execShared(modopt_t *options, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost);
+int pg_execLookup(modopt_t *options, PGresult **res, const char *query, const char *service, const char *user, const char *passwd, const char *rhost);
+void pg_locateUser(modopt_t *options, const char *service, const char *user, const char *rhost);
+int backend_client_allowed(modopt_t *options, const char *rhost);
+int backend_verify(modopt_t *options, const char *user, const char *passwd, PGresult *res);
 int backend_authenticate(const char *service, const char *user, const char *passwd, const char *rhost, modopt_t *options);
 char * password_encrypt(modopt_t *options, const char *user, const char *pass, const char *salt);
 
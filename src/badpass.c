@@ -0,0 +1,215 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Wrong password cache: with wrong_password_ttl set, a password that
+ * failed for a user is remembered for that many seconds, and the same
+ * password for the same user is refused again without hashing it.  Only
+ * HMAC-SHA256 fingerprints are kept, under a random key made when the
+ * table is created, never passwords.
+ *
+ * Each entry also holds a fingerprint of the stored passwords the
+ * failure was checked against, and only counts while auth_query still
+ * returns those: a password changed elsewhere works right away.  With
+ * pw_type function the result says nothing about the stored password,
+ * so there the check is done before asking the database at all, and a
+ * change made elsewhere takes up to wrong_password_ttl to be noticed.
+ * Whenever the password is changed here, the user's entries are
+ * dropped.  A user's entries live in one set of BADPASS_WAYS slots in
+ * shared memory, the oldest one makes room.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <gcrypt.h>
+#include <libpq-fe.h>
+
+#include "pam_pgsql.h"
+#include "badpass.h"
+#include "shm.h"
+
+#define BADPASS_SHM      "/pam_pgsql_badpass"
+#define BADPASS_SETS     2048
+#define BADPASS_WAYS     8
+#define BADPASS_KEYLEN   32
+
+struct badpass {
+	unsigned long long user;	/* fingerprint of the user name */
+	unsigned long long stored;	/* of the stored passwords */
+	unsigned char pass[16];		/* of user name and password */
+	time_t expires;			/* 0 when free */
+};
+
+struct badpass_table {
+	pid_t lock;
+	int keyed;
+	unsigned char key[BADPASS_KEYLEN];
+	struct badpass slot[BADPASS_SETS * BADPASS_WAYS];
+};
+
+static struct badpass_table *badpass = NULL;
+
+static struct badpass_table *
+badpass_table(void)
+{
+	if (badpass == NULL &&
+	    (badpass = shm_attach(BADPASS_SHM, sizeof(struct badpass_table))) != NULL &&
+	    !__atomic_load_n(&badpass->keyed, __ATOMIC_ACQUIRE)) {
+		shm_lock(&badpass->lock);
+		if (!badpass->keyed) {
+			gcry_randomize(badpass->key, BADPASS_KEYLEN, GCRY_STRONG_RANDOM);
+			__atomic_store_n(&badpass->keyed, 1, __ATOMIC_RELEASE);
+		}
+		shm_unlock(&badpass->lock);
+	}
+	return badpass;
+}
+
+/* private: HMAC of the NUL terminated strings (up to a NULL) into out */
+static int
+badpass_hmac(struct badpass_table *t, void *out, size_t len, const char *s, ...)
+{
+	gcry_md_hd_t h;
+	va_list ap;
+
+	if (gcry_md_open(&h, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC) != 0)
+		return -1;
+	if (gcry_md_setkey(h, t->key, BADPASS_KEYLEN) != 0) {
+		gcry_md_close(h);
+		return -1;
+	}
+	va_start(ap, s);
+	for (; s != NULL; s = va_arg(ap, const char *))
+		gcry_md_write(h, s, strlen(s) + 1);
+	va_end(ap);
+	memcpy(out, gcry_md_read(h, GCRY_MD_SHA256), len);
+	gcry_md_close(h);
+	return 0;
+}
+
+/* private: the user's set, and the fingerprints of user and password */
+static struct badpass *
+badpass_set(struct badpass_table *t, const char *user, const char *pass,
+    unsigned long long *ufp, unsigned char *pfp)
+{
+	if (badpass_hmac(t, ufp, sizeof(*ufp), user, NULL) != 0 ||
+	    (pass != NULL && badpass_hmac(t, pfp, 16, user, pass, NULL) != 0))
+		return NULL;
+	return &t->slot[(*ufp % BADPASS_SETS) * BADPASS_WAYS];
+}
+
+/* private: fingerprint of the stored passwords in res, 0 for function results */
+static int
+badpass_stored(struct badpass_table *t, modopt_t *options, PGresult *res, unsigned long long *sfp)
+{
+	gcry_md_hd_t h;
+	int i;
+
+	*sfp = 0;
+	if (options->pw_type == PW_FUNCTION || res == NULL)
+		return 0;
+	if (gcry_md_open(&h, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC) != 0)
+		return -1;
+	gcry_md_setkey(h, t->key, BADPASS_KEYLEN);
+	for (i = 0; i < PQntuples(res); i++)
+		gcry_md_write(h, PQgetvalue(res, i, 0), PQgetlength(res, i, 0) + 1);
+	memcpy(sfp, gcry_md_read(h, GCRY_MD_SHA256), sizeof(*sfp));
+	gcry_md_close(h);
+	return 0;
+}
+
+/*
+ * Was this password refused for the user within wrong_password_ttl,
+ * against the same stored passwords as in the auth_query result res?
+ * res is NULL for pw_type function, see above.
+ */
+int
+badpass_seen(modopt_t *options, const char *user, const char *pass, PGresult *res)
+{
+	struct badpass_table *t;
+	struct badpass *set;
+	unsigned long long ufp, sfp;
+	unsigned char pfp[16];
+	time_t now = time(NULL);
+	int i, seen = 0;
+
+	if (options->wrong_password_ttl <= 0 || user == NULL || pass == NULL ||
+	    (t = badpass_table()) == NULL || (set = badpass_set(t, user, pass, &ufp, pfp)) == NULL ||
+	    badpass_stored(t, options, res, &sfp) != 0)
+		return 0;
+
+	shm_lock(&t->lock);
+	for (i = 0; i < BADPASS_WAYS && !seen; i++)
+		seen = set[i].expires > now && set[i].user == ufp && set[i].stored == sfp &&
+		    !memcmp(set[i].pass, pfp, 16);
+	shm_unlock(&t->lock);
+	return seen;
+}
+
+/*
+ * Note the outcome of checking pass against the auth_query result res:
+ * entries made against other stored passwords go, and a wrong password
+ * (rc PAM_AUTH_ERR) is remembered.
+ */
+void
+badpass_record(modopt_t *options, const char *user, const char *pass, PGresult *res, int rc)
+{
+	struct badpass_table *t;
+	struct badpass *set, *slot;
+	unsigned long long ufp, sfp;
+	unsigned char pfp[16];
+	time_t now = time(NULL);
+	int i;
+
+	/* what the password was checked against */
+	if (options->wrong_password_ttl <= 0 || user == NULL || pass == NULL ||
+	    (t = badpass_table()) == NULL || (set = badpass_set(t, user, pass, &ufp, pfp)) == NULL ||
+	    badpass_stored(t, options, res, &sfp) != 0)
+		return;
+
+	shm_lock(&t->lock);
+	slot = NULL;
+	for (i = 0; i < BADPASS_WAYS; i++) {
+		if (set[i].expires != 0 && set[i].user == ufp && set[i].stored != sfp)
+			set[i].expires = 0;
+		if (set[i].expires != 0 && set[i].user == ufp && !memcmp(set[i].pass, pfp, 16))
+			slot = &set[i];
+	}
+	if (rc == PAM_AUTH_ERR) {
+		/* else the slot expiring first, free and expired ones come before any other */
+		if (slot == NULL) {
+			slot = &set[0];
+			for (i = 1; i < BADPASS_WAYS; i++)
+				if (set[i].expires < slot->expires)
+					slot = &set[i];
+		}
+		slot->user = ufp;
+		slot->stored = sfp;
+		memcpy(slot->pass, pfp, 16);
+		slot->expires = now + options->wrong_password_ttl;
+	}
+	shm_unlock(&t->lock);
+}
+
+/* drop the user's entries, the password was changed */
+void
+badpass_forget(modopt_t *options, const char *user)
+{
+	struct badpass_table *t;
+	struct badpass *set;
+	unsigned long long ufp;
+	int i;
+
+	if (options->wrong_password_ttl <= 0 || user == NULL ||
+	    (t = badpass_table()) == NULL || (set = badpass_set(t, user, NULL, &ufp, NULL)) == NULL)
+		return;
+
+	shm_lock(&t->lock);
+	for (i = 0; i < BADPASS_WAYS; i++)
+		if (set[i].user == ufp)
+			set[i].expires = 0;
+	shm_unlock(&t->lock);
+}
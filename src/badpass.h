@@ -0,0 +1,11 @@
+#ifndef __PAM_PGSQL_BADPASS_H
+#define __PAM_PGSQL_BADPASS_H
+
+#include <libpq-fe.h>
+#include "pam_pgsql_options.h"
+
+int badpass_seen(modopt_t *options, const char *user, const char *pass, PGresult *res);
+void badpass_record(modopt_t *options, const char *user, const char *pass, PGresult *res, int rc);
+void badpass_forget(modopt_t *options, const char *user);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Breached passwords: with breach_file set, pam_sm_chauthtok() refuses
+ * a new password whose SHA-1 is in the index built by pam_pgsql_breach
+ * from a corpus of leaked passwords.  The index is mapped, not read, and
+ * kept for the lifetime of the process; it is mapped again when the file
+ * is replaced.  A lookup reads the bucket ends in the fan-out table and
+ * then interpolates within the bucket (the hashes are uniform), so it
+ * touches a page or two of a file of many gigabytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <gcrypt.h>
+
+#include "pam_pgsql.h"
+#include "breach.h"
+
+struct breach_index {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	const unsigned char *map;
+	unsigned long long count;
+	int refs;
+	int stale;
+	struct breach_index *next;
+};
+
+static pthread_mutex_t breach_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct breach_index *breach_indexes = NULL;
+
+static unsigned long long
+be64(const unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static void
+breach_free(struct breach_index *b)
+{
+	munmap((void *) b->map, b->size);
+	free(b->path);
+	free(b);
+}
+
+/* private: map and sanity check the index */
+static struct breach_index *
+breach_open(modopt_t *options, const char *path, struct stat *st)
+{
+	struct breach_index *b;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	map = st->st_size >= BREACH_RECORDS ? mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED || memcmp(map, BREACH_MAGIC, 8) != 0 ||
+	    BREACH_RECORDS + be64((unsigned char *) map + 8) * BREACH_HASHLEN != (unsigned long long) st->st_size) {
+		SYSLOG("%s is not a breached password index", path);
+		if (map != MAP_FAILED)
+			munmap(map, st->st_size);
+		return NULL;
+	}
+	madvise(map, st->st_size, MADV_RANDOM);
+
+	b = calloc(1, sizeof(struct breach_index));
+	b->path = strdup(path);
+	b->dev = st->st_dev;
+	b->ino = st->st_ino;
+	b->size = st->st_size;
+	b->mtime = st->st_mtime;
+	b->map = map;
+	b->count = be64(b->map + 8);
+	DBGLOG("mapped %llu breached password hashes from %s", b->count, path);
+	return b;
+}
+
+/* private: get a reference to the index, mapping it (again) if needed */
+static struct breach_index *
+breach_get(modopt_t *options, const char *path)
+{
+	struct breach_index *b, **pb;
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		SYSLOG("can't use breached password index %s", path);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&breach_lock);
+	for (pb = &breach_indexes; (b = *pb) != NULL; pb = &b->next)
+		if (!strcmp(b->path, path))
+			break;
+
+	if (b != NULL && (b->dev != st.st_dev || b->ino != st.st_ino ||
+	                  b->size != st.st_size || b->mtime != st.st_mtime)) {
+		/* unlink the old version, the last user unmaps it */
+		*pb = b->next;
+		b->stale = 1;
+		if (b->refs == 0)
+			breach_free(b);
+		b = NULL;
+	}
+
+	if (b == NULL && (b = breach_open(options, path, &st)) != NULL) {
+		b->next = breach_indexes;
+		breach_indexes = b;
+	}
+	if (b != NULL)
+		b->refs++;
+	pthread_mutex_unlock(&breach_lock);
+
+	return b;
+}
+
+static void
+breach_put(struct breach_index *b)
+{
+	pthread_mutex_lock(&breach_lock);
+	if (--b->refs == 0 && b->stale)
+		breach_free(b);
+	pthread_mutex_unlock(&breach_lock);
+}
+
+/* private: interpolation search for hash in its bucket */
+static int
+breach_find(struct breach_index *b, const unsigned char *hash)
+{
+	const unsigned char *records = b->map + BREACH_RECORDS, *r;
+	unsigned int bucket = (hash[0] << 8) | hash[1];
+	unsigned long long lo, hi, mid, key, klo = 0, khi = ~0ULL;
+	int c;
+
+	lo = bucket ? be64(b->map + 16 + 8 * (bucket - 1)) : 0;
+	hi = be64(b->map + 16 + 8 * bucket);
+	if (hi > b->count || lo > hi)
+		return 0;
+
+	/* the bytes after the bucket number are spread evenly over klo..khi */
+	key = be64(hash + 2);
+	while (lo < hi) {
+		if (hi - lo > 8 && key >= klo && key <= khi && khi > klo)
+			mid = lo + (unsigned long long) ((double) (key - klo) / (double) (khi - klo) * (hi - lo - 1));
+		else
+			mid = lo + (hi - lo) / 2;
+		r = records + mid * BREACH_HASHLEN;
+		if ((c = memcmp(r, hash, BREACH_HASHLEN)) == 0)
+			return 1;
+		if (c < 0) {
+			lo = mid + 1;
+			klo = be64(r + 2);
+		} else {
+			hi = mid;
+			khi = be64(r + 2);
+		}
+	}
+	return 0;
+}
+
+/* PAM_AUTHTOK_ERR if the password is in the breach_file index */
+int
+breach_check(modopt_t *options, const char *pass)
+{
+	struct breach_index *b;
+	unsigned char hash[BREACH_HASHLEN];
+	int found;
+
+	if (options->breach_file == NULL || pass == NULL)
+		return PAM_SUCCESS;
+
+	/* a missing or broken index doesn't stop anybody from changing passwords */
+	if ((b = breach_get(options, options->breach_file)) == NULL)
+		return PAM_SUCCESS;
+
+	gcry_md_hash_buffer(GCRY_MD_SHA1, hash, pass, strlen(pass));
+	found = breach_find(b, hash);
+	breach_put(b);
+	return found ? PAM_AUTHTOK_ERR : PAM_SUCCESS;
+}
@@ -0,0 +1,18 @@
+#ifndef __PAM_PGSQL_BREACH_H
+#define __PAM_PGSQL_BREACH_H
+
+#include "pam_pgsql_options.h"
+
+/*
+ * Index file: BREACH_MAGIC, the number of hashes and BREACH_FANOUT
+ * bucket ends (all 8 byte big endian), then the sorted 20 byte SHA-1
+ * hashes.  Bucket i holds the hashes whose first two bytes are i.
+ */
+#define BREACH_MAGIC      "PGBRCH01"
+#define BREACH_FANOUT     65536
+#define BREACH_HASHLEN    20
+#define BREACH_RECORDS    (16 + 8 * BREACH_FANOUT)
+
+int breach_check(modopt_t *options, const char *pass);
+
+#endif
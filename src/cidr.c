@@ -0,0 +1,256 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Prefix tables loaded from plain text files, one "address/len [tag]"
+ * per line.  Every file is compiled into a binary trie over the IPv6
+ * address space (IPv4 lives under ::ffff:0:0/96) and kept around for
+ * the lifetime of the process; it is recompiled when the file changes
+ * on disk, so tables can be edited without restarting anything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "cidr.h"
+#include "pam_pgsql.h"
+
+struct cidr_node {
+	unsigned int child[2];	/* 0 means no child, the root is never a child */
+	int tag;		/* index in tags, -1 if no prefix ends here */
+};
+
+struct cidr_table_s {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	int refs;
+	int stale;
+
+	struct cidr_node *nodes;
+	unsigned int nnodes, anodes;
+	char **tags;
+	int ntags, atags;
+
+	struct cidr_table_s *next;
+};
+
+static pthread_mutex_t cidr_lock = PTHREAD_MUTEX_INITIALIZER;
+static cidr_table_t *cidr_tables = NULL;
+
+/* private: parse an address into 16 bytes, IPv4 as v4-mapped */
+static int
+cidr_parse_addr(const char *s, unsigned char *addr, int *v4)
+{
+	if (inet_pton(AF_INET6, s, addr) == 1) {
+		*v4 = 0;
+		return 1;
+	}
+	if (inet_pton(AF_INET, s, addr + 12) == 1) {
+		memset(addr, 0, 10);
+		addr[10] = addr[11] = 0xff;
+		*v4 = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned int
+cidr_new_node(cidr_table_t *t)
+{
+	if (t->nnodes == t->anodes) {
+		t->anodes = t->anodes ? t->anodes * 2 : 256;
+		t->nodes = realloc(t->nodes, t->anodes * sizeof(struct cidr_node));
+	}
+	t->nodes[t->nnodes].child[0] = t->nodes[t->nnodes].child[1] = 0;
+	t->nodes[t->nnodes].tag = -1;
+	return t->nnodes++;
+}
+
+static int
+cidr_new_tag(cidr_table_t *t, const char *tag)
+{
+	int i;
+
+	for (i = 0; i < t->ntags; i++)
+		if (!strcmp(t->tags[i], tag))
+			return i;
+	if (t->ntags == t->atags) {
+		t->atags = t->atags ? t->atags * 2 : 16;
+		t->tags = realloc(t->tags, t->atags * sizeof(char *));
+	}
+	t->tags[t->ntags] = strdup(tag);
+	return t->ntags++;
+}
+
+static void
+cidr_insert(cidr_table_t *t, const unsigned char *addr, int bits, int tag)
+{
+	unsigned int n = 0, next;
+	int i, b;
+
+	for (i = 0; i < bits; i++) {
+		b = (addr[i >> 3] >> (7 - (i & 7))) & 1;
+		if (!(next = t->nodes[n].child[b])) {
+			next = cidr_new_node(t);
+			t->nodes[n].child[b] = next;
+		}
+		n = next;
+	}
+	t->nodes[n].tag = tag;
+}
+
+/* private: compile the file, NULL if it can't be read */
+static cidr_table_t *
+cidr_compile(const char *path, struct stat *st)
+{
+	cidr_table_t *t;
+	FILE *fp;
+	char buffer[1024], *p, *slash, *tag, *end;
+	unsigned char addr[16];
+	int bits, v4, lineno = 0;
+	long len;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		SYSLOG("can't open network table %s", path);
+		return NULL;
+	}
+
+	t = calloc(1, sizeof(cidr_table_t));
+	t->path = strdup(path);
+	t->dev = st->st_dev;
+	t->ino = st->st_ino;
+	t->size = st->st_size;
+	t->mtime = st->st_mtime;
+	cidr_new_node(t);
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		lineno++;
+		if ((p = strchr(buffer, '#')))
+			*p = '\0';
+		for (p = buffer; isspace(*p); p++);
+		if (*p == '\0')
+			continue;
+		for (end = p; *end && !isspace(*end); end++);
+		tag = end;
+		if (*end) {
+			*end = '\0';
+			for (tag = end + 1; isspace(*tag); tag++);
+			for (end = tag + strlen(tag); end > tag && isspace(end[-1]); end--);
+			*end = '\0';
+		}
+
+		bits = -1;
+		if ((slash = strchr(p, '/'))) {
+			*slash = '\0';
+			/* "/", "/x" or "/8x" must not become /0 and match everything */
+			bits = -2;
+			if (isdigit((unsigned char) slash[1])) {
+				len = strtol(slash + 1, &end, 10);
+				if (*end == '\0' && len <= 128)
+					bits = len;
+			}
+		}
+		if (bits == -2 || !cidr_parse_addr(p, addr, &v4) || bits > (v4 ? 32 : 128)) {
+			SYSLOG("%s:%d: bad network '%s', ignored", path, lineno, p);
+			continue;
+		}
+		if (bits < 0)
+			bits = v4 ? 32 : 128;
+		cidr_insert(t, addr, v4 ? bits + 96 : bits, cidr_new_tag(t, tag));
+	}
+	fclose(fp);
+
+	return t;
+}
+
+static void
+cidr_free(cidr_table_t *t)
+{
+	int i;
+
+	for (i = 0; i < t->ntags; i++)
+		free(t->tags[i]);
+	free(t->tags);
+	free(t->nodes);
+	free(t->path);
+	free(t);
+}
+
+/* get a reference to the compiled table for path, reloading it if needed */
+cidr_table_t *
+cidr_table_get(const char *path)
+{
+	cidr_table_t *t, **pt;
+	struct stat st;
+
+	if (path == NULL || stat(path, &st) != 0)
+		return NULL;
+
+	pthread_mutex_lock(&cidr_lock);
+	for (pt = &cidr_tables; (t = *pt) != NULL; pt = &t->next)
+		if (!strcmp(t->path, path))
+			break;
+
+	if (t != NULL && (t->dev != st.st_dev || t->ino != st.st_ino ||
+	                  t->size != st.st_size || t->mtime != st.st_mtime)) {
+		/* unlink the old version, the last user frees it */
+		*pt = t->next;
+		t->stale = 1;
+		if (t->refs == 0)
+			cidr_free(t);
+		t = NULL;
+	}
+
+	if (t == NULL && (t = cidr_compile(path, &st)) != NULL) {
+		t->next = cidr_tables;
+		cidr_tables = t;
+	}
+	if (t != NULL)
+		t->refs++;
+	pthread_mutex_unlock(&cidr_lock);
+
+	return t;
+}
+
+void
+cidr_table_put(cidr_table_t *t)
+{
+	if (t == NULL)
+		return;
+	pthread_mutex_lock(&cidr_lock);
+	if (--t->refs == 0 && t->stale)
+		cidr_free(t);
+	pthread_mutex_unlock(&cidr_lock);
+}
+
+/* longest prefix match, returns the tag or NULL */
+const char *
+cidr_lookup(cidr_table_t *t, const char *s)
+{
+	unsigned char addr[16];
+	unsigned int n = 0;
+	int i, v4, tag = -1;
+
+	if (t == NULL || s == NULL || !cidr_parse_addr(s, addr, &v4))
+		return NULL;
+
+	for (i = 0; i < 128; i++) {
+		if (t->nodes[n].tag >= 0)
+			tag = t->nodes[n].tag;
+		if (!(n = t->nodes[n].child[(addr[i >> 3] >> (7 - (i & 7))) & 1]))
+			break;
+	}
+	if (i == 128 && t->nodes[n].tag >= 0)
+		tag = t->nodes[n].tag;
+
+	return tag >= 0 ? t->tags[tag] : NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef __PAM_PGSQL_CIDR_H
+#define __PAM_PGSQL_CIDR_H
+
+typedef struct cidr_table_s cidr_table_t;
+
+cidr_table_t * cidr_table_get(const char *path);
+void cidr_table_put(cidr_table_t *table);
+const char * cidr_lookup(cidr_table_t *table, const char *addr);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Flight recorder: with flight_recorder = 1 every PAM call leaves a
+ * compact record (when each phase started and how long it took, which
+ * failed, the database server, the result, DNS cache hit or miss; no
+ * user names or passwords) in a ring of FLIGHT_SLOTS entries in shared
+ * memory, so the last few thousand calls can be looked at with
+ * "pam_pgsql_stat recent" after an incident.
+ *
+ * Writers claim a slot with one atomic increment and mark it odd while
+ * they fill it in; readers skip slots that are odd or changed under them.
+ * Nothing ever waits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "pam_pgsql.h"
+#include "flight.h"
+#include "shm.h"
+
+#define FLIGHT_SHM     "/pam_pgsql_flight"
+#define FLIGHT_SLOTS   2048
+
+struct flight_ring {
+	unsigned long long next;
+	struct flight_event slot[FLIGHT_SLOTS];
+};
+
+/* what phases, calls and errors are called; events store the index */
+static const char *flight_names[] = {
+	"?", "pam_sm_authenticate", "pam_sm_acct_mgmt", "pam_sm_chauthtok",
+	"pam_sm_open_session", "pam_sm_close_session", "options", "dns",
+	"address_filter", "connect", "auth_query", "acct_query", "pwd_query",
+	"auth_succ_query", "auth_fail_query", "session_open_query",
+	"session_close_query", "query", "verify", "history_query",
+	"history_update_query", "history", NULL
+};
+
+static struct flight_ring *ring = NULL;
+
+int
+flight_name(const char *name)
+{
+	int i;
+
+	for (i = 1; flight_names[i] != NULL; i++)
+		if (!strcmp(flight_names[i], name))
+			return i;
+	return 0;
+}
+
+static struct flight_ring *
+flight_ring(void)
+{
+	if (ring == NULL)
+		ring = shm_attach(FLIGHT_SHM, sizeof(struct flight_ring));
+	return ring;
+}
+
+void
+flight_put(struct flight_event *e)
+{
+	struct flight_ring *r;
+	struct flight_event *slot;
+	unsigned long long n;
+
+	if ((r = flight_ring()) == NULL)
+		return;
+
+	n = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+	slot = &r->slot[n % FLIGHT_SLOTS];
+	__atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->seq = 2 * n + 1;
+	memcpy(slot, e, sizeof(*slot));
+	__atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+}
+
+/* private: copy of slot n, 0 if it is being written or was overwritten */
+static int
+flight_get(struct flight_ring *r, unsigned long long n, struct flight_event *e)
+{
+	struct flight_event *slot = &r->slot[n % FLIGHT_SLOTS];
+	unsigned long long seq;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq != 2 * n + 2)
+		return 0;
+	memcpy(e, slot, sizeof(*e));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+const char *
+flight_str(unsigned char name)
+{
+	return name < sizeof(flight_names) / sizeof(flight_names[0]) - 1 ? flight_names[name] : "?";
+}
+
+/* print the last limit calls, oldest first */
+int
+flight_dump(FILE *fp, int limit)
+{
+	static const char *cache[] = { "-", "hit", "miss" };
+	struct flight_ring *r;
+	struct flight_event e;
+	unsigned long long next, n;
+	char when[32];
+	time_t sec;
+	int i;
+
+	if ((r = flight_ring()) == NULL)
+		return -1;
+
+	next = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+	if (limit > FLIGHT_SLOTS)
+		limit = FLIGHT_SLOTS;
+	for (n = next > (unsigned long long) limit ? next - limit : 0; n < next; n++) {
+		if (!flight_get(r, n, &e))
+			continue;
+		sec = e.start_us / 1000000;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+		e.host[sizeof(e.host) - 1] = '\0';
+		e.service[sizeof(e.service) - 1] = '\0';
+		fprintf(fp, "%s.%06lld [%d] %s service=%s rc=%d error=%s dns=%s host=%s\n",
+		    when, e.start_us % 1000000, e.pid, flight_str(e.call),
+		    e.service[0] ? e.service : "-", e.rc,
+		    e.error == FLIGHT_NONE ? "-" : flight_str(e.error),
+		    cache[e.dns_cache % 3], e.host[0] ? e.host : "-");
+		for (i = 0; i < e.nphases && i < FLIGHT_PHASES; i++)
+			fprintf(fp, "    %-20s +%8uus %8uus (%uus cpu)%s\n", flight_str(e.phase[i].name),
+			    e.phase[i].start_us, e.phase[i].wall_us, e.phase[i].cpu_us,
+			    e.phase[i].failed ? " failed" : "");
+	}
+	return 0;
+}
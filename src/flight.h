@@ -0,0 +1,36 @@
+#ifndef __PAM_PGSQL_FLIGHT_H
+#define __PAM_PGSQL_FLIGHT_H
+
+#include <stdio.h>
+
+#define FLIGHT_PHASES   12
+#define FLIGHT_NONE     0xff
+#define FLIGHT_NAMES    32	/* room for the names of flight_name() */
+
+/* one PAM call as kept by the flight recorder; names are flight_name() indexes */
+struct flight_event {
+	unsigned long long seq;
+	long long start_us;
+	int pid;
+	short rc;
+	unsigned char call;
+	unsigned char error;		/* first phase that failed, or FLIGHT_NONE */
+	unsigned char dns_cache;	/* 0 no lookup, 1 hit, 2 miss */
+	unsigned char nphases;
+	struct {
+		unsigned char name;
+		unsigned char failed;
+		unsigned int start_us;	/* since the start of the call */
+		unsigned int wall_us;
+		unsigned int cpu_us;	/* of that, on the CPU */
+	} phase[FLIGHT_PHASES];
+	char host[48];
+	char service[24];
+};
+
+int flight_name(const char *name);
+const char * flight_str(unsigned char name);
+void flight_put(struct flight_event *e);
+int flight_dump(FILE *fp, int limit);
+
+#endif
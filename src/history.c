@@ -0,0 +1,152 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Password history: with history_query set, pam_sm_chauthtok() refuses
+ * a new password matching one of the stored passwords the query returns
+ * (say the last 24).  Hashes such as crypt_sha512 are slow on purpose,
+ * so the rows are checked by up to history_threads threads, each taking
+ * the next row nobody has looked at yet; all of them stop at the first
+ * match.  With pw_type = function the query does the comparison itself,
+ * like auth_query, and returns 't' for a match.
+ *
+ * With history_update_query the new password is recorded in the same
+ * transaction as pwd_query, so the two can't get out of step.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+
+#include "pam_pgsql.h"
+#include "backend_pgsql.h"
+#include "history.h"
+#include "trace.h"
+
+#define HISTORY_MAX_THREADS  32
+
+struct history_job {
+	modopt_t *options;
+	const char *user;
+	const char *pass;
+	PGresult *res;
+	int next;		/* next row to check */
+	int found;
+};
+
+/* private: check rows until there are none left or one matched */
+static void *
+history_worker(void *arg)
+{
+	struct history_job *job = arg;
+	char *stored, *tmp;
+	int i;
+
+	while (!__atomic_load_n(&job->found, __ATOMIC_RELAXED) &&
+	    (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < PQntuples(job->res)) {
+		if (PQgetisnull(job->res, i, 0))
+			continue;
+		stored = PQgetvalue(job->res, i, 0);
+		if (job->options->pw_type == PW_FUNCTION) {
+			if (!strcmp(stored, "t"))
+				__atomic_store_n(&job->found, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		tmp = password_encrypt(job->options, job->user, job->pass, stored);
+		if (tmp != NULL && !strcmp(stored, tmp))
+			__atomic_store_n(&job->found, 1, __ATOMIC_RELAXED);
+		free(tmp);
+	}
+	return NULL;
+}
+
+/* PAM_SUCCESS if newpass isn't in the history, PAM_AUTHTOK_ERR if it is */
+int
+history_check(modopt_t *options, PGconn *conn, const char *service, const char *user, const char *newpass, const char *rhost)
+{
+	struct history_job job;
+	pthread_t threads[HISTORY_MAX_THREADS];
+	int rc, span, nthreads, started, i;
+
+	if (options->history_query == NULL)
+		return PAM_SUCCESS;
+
+	DBGLOG("query: %s", options->history_query);
+	job.res = NULL;
+	if (pg_execParam(options, conn, &job.res, options->history_query, service, user, newpass, rhost) != PAM_SUCCESS) {
+		PQclear(job.res);
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+
+	span = trace_span(options, "history");
+	trace_attr_int(options, span, "history.rows", PQntuples(job.res));
+	job.options = options;
+	job.user = user;
+	job.pass = newpass;
+	job.next = 0;
+	job.found = 0;
+
+	/* this thread is one of the workers */
+	nthreads = options->pw_type == PW_FUNCTION ? 1 : options->history_threads;
+	if (nthreads > PQntuples(job.res))
+		nthreads = PQntuples(job.res);
+	if (nthreads > HISTORY_MAX_THREADS)
+		nthreads = HISTORY_MAX_THREADS;
+	for (started = 0; started < nthreads - 1; started++)
+		if (pthread_create(&threads[started], NULL, history_worker, &job) != 0)
+			break;
+	history_worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	rc = job.found ? PAM_AUTHTOK_ERR : PAM_SUCCESS;
+	trace_end_rc(options, span, rc);
+	PQclear(job.res);
+	return rc;
+}
+
+/* private: run a transaction control statement */
+static int
+history_exec(modopt_t *options, PGconn *conn, const char *command)
+{
+	PGresult *res;
+	int rc = PAM_SUCCESS;
+
+	res = PQexec(conn, command);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		SYSLOG("PostgreSQL %s failed: '%s'", command, PQresultErrorMessage(res));
+		rc = PAM_AUTH_ERR;
+	}
+	PQclear(res);
+	return rc;
+}
+
+/* run pwd_query, and history_update_query in the same transaction if it is set */
+int
+history_change(modopt_t *options, PGconn *conn, const char *service, const char *user, const char *newpass_crypt, const char *rhost)
+{
+	PGresult *res = NULL;
+	int rc;
+
+	if (options->history_update_query == NULL) {
+		rc = pg_execParam(options, conn, &res, options->query_pwd, service, user, newpass_crypt, rhost);
+		PQclear(res);
+		return rc == PAM_SUCCESS ? PAM_SUCCESS : PAM_AUTH_ERR;
+	}
+
+	if (history_exec(options, conn, "BEGIN") != PAM_SUCCESS)
+		return PAM_AUTH_ERR;
+	rc = pg_execParam(options, conn, &res, options->query_pwd, service, user, newpass_crypt, rhost);
+	PQclear(res);
+	if (rc == PAM_SUCCESS) {
+		DBGLOG("query: %s", options->history_update_query);
+		res = NULL;
+		rc = pg_execParam(options, conn, &res, options->history_update_query, service, user, newpass_crypt, rhost);
+		PQclear(res);
+	}
+	if (rc == PAM_SUCCESS)
+		return history_exec(options, conn, "COMMIT");
+	history_exec(options, conn, "ROLLBACK");
+	return PAM_AUTH_ERR;
+}
@@ -0,0 +1,10 @@
+#ifndef __PAM_PGSQL_HISTORY_H
+#define __PAM_PGSQL_HISTORY_H
+
+#include <libpq-fe.h>
+#include "pam_pgsql_options.h"
+
+int history_check(modopt_t *options, PGconn *conn, const char *service, const char *user, const char *newpass, const char *rhost);
+int history_change(modopt_t *options, PGconn *conn, const char *service, const char *user, const char *newpass_crypt, const char *rhost);
+
+#endif
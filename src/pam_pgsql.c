@@ -26,8 +26,17 @@
 #include <security/pam_appl.h>
 
 #include "backend_pgsql.h"
+#include "badpass.h"
+#include "breach.h"
+#include "history.h"
 #include "pam_pgsql.h"
 #include "pam_pgsql_options.h"
+#include "replica.h"
+#include "sessions.h"
+#include "topk.h"
+#include "trace.h"
+#include "userfilter.h"
+#include "write_behind.h"
 
 #if SUPPORT_ATTRIBUTE_VISIBILITY_DEFAULT
 # define PAM_VISIBLE PAM_EXTERN __attribute__((visibility("default")))
@@ -35,17 +44,31 @@
 # define PAM_VISIBLE PAM_EXTERN
 #endif
 
+/* private: start the trace of a PAM call, if this one is sampled */
+static void
+trace_call(pam_handle_t *pamh, modopt_t *options, const char *name, const trace_time_t *since)
+{
+	const char *rhost = NULL;
+
+	trace_start(options, name, since, pam_getenv(pamh, "TRACEPARENT"));
+	trace_attr(options, 0, "pam.service", pam_get_service(pamh));
+	if (pam_get_item(pamh, PAM_RHOST, (const void **)&rhost) == PAM_SUCCESS)
+		trace_attr(options, 0, "client.address", rhost);
+}
+
 /* public: authenticate user */
 PAM_VISIBLE int
 pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
 	modopt_t *options = NULL;
 	const char *user, *password, *rhost;
-	int rc;
+	int rc, blocked;
 	PGresult *res;
 	PGconn *conn;	
+	trace_time_t start;
 
-	user = NULL; password = NULL; rhost = NULL;
+	trace_clock(&start);
+	user = NULL; password = NULL; rhost = NULL; blocked = 0;
 
 	if ((rc = pam_get_item(pamh, PAM_RHOST, (const void **)&rhost)) == PAM_SUCCESS) {
 
@@ -53,10 +76,26 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 
 			if ((options = mod_options(argc, argv)) != NULL) {
 
+				mod_options_service(options, pam_get_service(pamh));
+				mod_options_user(options, user);
+				mod_options_priority_claim(options, user);
+				trace_call(pamh, options, "pam_sm_authenticate", &start);
+				trace_attr(options, 0, "enduser.id", user);
 				DBGLOG("attempting to authenticate: %s, %s", user, options->query_auth);
-				if ((rc = pam_get_pass(pamh, PAM_AUTHTOK, &password, PASSWORD_PROMPT, options->std_flags)) == PAM_SUCCESS) {
+				if ((rc = backend_client_allowed(options, rhost)) != PAM_SUCCESS) {
+
+					/* rejected locally, don't bother the database at all */
+					blocked = 1;
+
+				} else if ((rc = pam_get_pass(pamh, PAM_AUTHTOK, &password, PASSWORD_PROMPT, options->std_flags)) == PAM_SUCCESS) {
+
+					if ((rc = userfilter_check(options, user)) != PAM_SUCCESS) {
 
-					if ((rc = backend_authenticate(pam_get_service(pamh), user, password, rhost, options)) == PAM_SUCCESS) {
+						/* not in the user filter, no such account; asked for the password all the same */
+						blocked = 1;
+						SYSLOG("couldn't authenticate unknown user %s", user);
+
+					} else if ((rc = backend_authenticate(pam_get_service(pamh), user, password, rhost, options)) == PAM_SUCCESS) {
 						if ((password == 0 || *password == 0) && (flags & PAM_DISALLOW_NULL_AUTHTOK)) {
 							rc = PAM_AUTH_ERR; 
 						} else {
@@ -83,25 +122,35 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		}
 	}
 	
+	if (options != NULL)
+		topk_record(options, user, rhost, rc);
+
 	if (rc == PAM_SUCCESS) {
-		if (options->query_auth_succ) {
+		/* the user is who they claimed now */
+		mod_options_priority(options, user);
+		if (options->query_auth_succ_batch && write_behind_record(options, WB_SUCCESS, user) == PAM_SUCCESS) {
+			/* queued, written later with the others */
+		} else if (options->query_auth_succ) {
 			if ((conn = db_connect(options))) {
-				pg_execParam(conn, &res, options->query_auth_succ, pam_get_service(pamh), user, password, rhost);
+				pg_execParam(options, conn, &res, options->query_auth_succ, pam_get_service(pamh), user, password, rhost);
 				PQclear(res);
-				PQfinish(conn);
+				db_release(options, conn);
 			}
 		}
-	} else {
-		if (options->query_auth_fail) {
+	} else if (!blocked) {
+		if (options->query_auth_fail_batch && write_behind_record(options, WB_FAILURE, user) == PAM_SUCCESS) {
+			/* likewise */
+		} else if (options->query_auth_fail) {
 			if ((conn = db_connect(options))) {
-				pg_execParam(conn, &res, options->query_auth_fail, pam_get_service(pamh), user, password, rhost);
+				pg_execParam(options, conn, &res, options->query_auth_fail, pam_get_service(pamh), user, password, rhost);
 				PQclear(res);
-				PQfinish(conn);
+				db_release(options, conn);
 			}
 		}
 	}
 
-	//free_mod_options(options);
+	trace_finish(options, rc);
+	free_mod_options(options);
 	return rc;
 }
 
@@ -113,54 +162,72 @@ pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc,
 	modopt_t *options = NULL;
 	const char *user, *rhost;
 	int rc = PAM_AUTH_ERR;
-	PGconn *conn;
 	PGresult *res;
+	trace_time_t start;
 
+	trace_clock(&start);
 	user = NULL; rhost = NULL;
 
 	if ((options = mod_options(argc, argv)) != NULL) {
 
+		mod_options_service(options, pam_get_service(pamh));
+		trace_call(pamh, options, "pam_sm_acct_mgmt", &start);
+
+		/* pam_sm_open_session checks again, this is to refuse early */
+		if (options->max_sessions > 0 && pam_get_user(pamh, &user, NULL) == PAM_SUCCESS &&
+		    ((rc = session_count(options, user)) >= options->max_sessions || rc < 0)) {
+			if (rc < 0) {
+				SYSLOG("(%s) sessions of user %s can't be counted", pam_get_service(pamh), user);
+			} else {
+				SYSLOG("(%s) user %s already has %d sessions", pam_get_service(pamh), user, options->max_sessions);
+			}
+			trace_finish(options, PAM_PERM_DENIED);
+			free_mod_options(options);
+			return PAM_PERM_DENIED;
+		}
+
 		/* query not specified, just succeed. */
 		if (options->query_acct == NULL) {
-			//free_module_options(options);
+			trace_finish(options, PAM_SUCCESS);
+			free_mod_options(options);
 			return PAM_SUCCESS;
 		}
 
 		if ((rc = pam_get_item(pamh, PAM_RHOST, (const void **)&rhost)) == PAM_SUCCESS) {
 			if((rc = pam_get_user(pamh, &user, NULL)) == PAM_SUCCESS) {
-				if(!(conn = db_connect(options))) {
-					rc = PAM_AUTH_ERR;
-				} else {
-					DBGLOG("query: %s", options->query_acct);
-					rc = PAM_AUTH_ERR;
-					if(pg_execParam(conn, &res, options->query_acct, pam_get_service(pamh), user, NULL, rhost) == PAM_SUCCESS) {
-						if (PQntuples(res) == 1 &&
-						    PQnfields(res) >= 2 && PQnfields(res) <= 3) {
-							char *expired_db = PQgetvalue(res, 0, 0);
-							char *newtok_db = PQgetvalue(res, 0, 1);
-							rc = PAM_SUCCESS;
-							if (PQnfields(res)>=3) {
-								char *nulltok_db = PQgetvalue(res, 0, 2);
-								if ((!strcmp(nulltok_db, "t")) && (flags & PAM_DISALLOW_NULL_AUTHTOK))
-									rc = PAM_NEW_AUTHTOK_REQD;
-							}
-							if (!strcmp(newtok_db, "t"))
+				mod_options_user(options, user);
+				/* authenticated by now, by us or otherwise */
+				mod_options_priority(options, user);
+				trace_attr(options, 0, "enduser.id", user);
+				DBGLOG("query: %s", options->query_acct);
+				rc = PAM_AUTH_ERR;
+				if(pg_execLookup(options, &res, options->query_acct, pam_get_service(pamh), user, NULL, rhost) == PAM_SUCCESS) {
+					if (PQntuples(res) == 1 &&
+					    PQnfields(res) >= 2 && PQnfields(res) <= 3) {
+						char *expired_db = PQgetvalue(res, 0, 0);
+						char *newtok_db = PQgetvalue(res, 0, 1);
+						rc = PAM_SUCCESS;
+						if (PQnfields(res)>=3) {
+							char *nulltok_db = PQgetvalue(res, 0, 2);
+							if ((!strcmp(nulltok_db, "t")) && (flags & PAM_DISALLOW_NULL_AUTHTOK))
 								rc = PAM_NEW_AUTHTOK_REQD;
-							if (!strcmp(expired_db, "t"))
-								rc = PAM_ACCT_EXPIRED;
-						} else {
-							DBGLOG("query_acct should return one row and two or three columns");
-							rc = PAM_PERM_DENIED;
 						}
-						PQclear(res);
+						if (!strcmp(newtok_db, "t"))
+							rc = PAM_NEW_AUTHTOK_REQD;
+						if (!strcmp(expired_db, "t"))
+							rc = PAM_ACCT_EXPIRED;
+					} else {
+						DBGLOG("query_acct should return one row and two or three columns");
+						rc = PAM_PERM_DENIED;
 					}
-					PQfinish(conn);
+					PQclear(res);
 				}
 			}
 		}
 	}
 
-	//free_module_options(options);
+	trace_finish(options, rc);
+	free_mod_options(options);
 	return rc;
 }
 
@@ -174,13 +241,22 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 	const void *oldtok;
 	char *newpass_crypt;
 	PGconn *conn;
-	PGresult *res;
+	trace_time_t start;
 
+	trace_clock(&start);
 	user = NULL; pass = NULL; newpass = NULL; rhost = NULL; newpass_crypt = NULL;
 
 	if ((options = mod_options(argc, argv)) != NULL) {
+		mod_options_service(options, pam_get_service(pamh));
+		trace_call(pamh, options, "pam_sm_chauthtok", &start);
 		if ((rc = pam_get_item(pamh, PAM_RHOST, (const void **)&rhost)) == PAM_SUCCESS) 
 			rc = pam_get_user(pamh, &user, NULL);
+		if (rc == PAM_SUCCESS) {
+			mod_options_user(options, user);
+			if (getuid() == 0)
+				mod_options_priority(options, user);
+			trace_attr(options, 0, "enduser.id", user);
+		}
 	} else
 		rc = 1;
 
@@ -204,31 +280,41 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 				pass = (const char*) oldtok;
 				if ((rc = backend_authenticate(pam_get_service(pamh), user, pass, rhost, options)) != PAM_SUCCESS) {
 					SYSLOG("(%s) user '%s' not authenticated.", pam_get_service(pamh), user);
+				} else {
+					mod_options_priority(options, user);
 				}
 			} else {
 				SYSLOG("could not retrieve old token");
 			}
 
 		} else {
+			/* nothing looked root's target up yet, so nothing found its shard */
+			pg_locateUser(options, pam_get_service(pamh), user, rhost);
 			rc = PAM_SUCCESS;
 		}
 
 		if (rc == PAM_SUCCESS) {
 
-			if ((rc = pam_get_confirm_pass(pamh, &newpass, PASSWORD_PROMPT_NEW, PASSWORD_PROMPT_CONFIRM, options->std_flags)) == PAM_SUCCESS) {
+			if ((rc = pam_get_confirm_pass(pamh, &newpass, PASSWORD_PROMPT_NEW, PASSWORD_PROMPT_CONFIRM, options->std_flags)) == PAM_SUCCESS &&
+			    (rc = breach_check(options, newpass)) == PAM_AUTHTOK_ERR) {
+				SYSLOG("(%s) user '%s' chose a breached password.", pam_get_service(pamh), user);
+			} else if (rc == PAM_SUCCESS) {
 				if((newpass_crypt = password_encrypt(options, user, newpass, NULL))) {
 					if(!(conn = db_connect(options))) {
 						rc = PAM_AUTHINFO_UNAVAIL;
+					} else if((rc = history_check(options, conn, pam_get_service(pamh), user, newpass, rhost)) == PAM_AUTHTOK_ERR) {
+						SYSLOG("(%s) user '%s' tried to reuse an old password.", pam_get_service(pamh), user);
 					}
 					if (rc == PAM_SUCCESS) {
 						DBGLOG("query: %s", options->query_pwd);
-						if(pg_execParam(conn, &res, options->query_pwd, pam_get_service(pamh), user, newpass_crypt, rhost) != PAM_SUCCESS) {
-							rc = PAM_AUTH_ERR;
-						} else {
+						if((rc = history_change(options, conn, pam_get_service(pamh), user, newpass_crypt, rhost)) == PAM_SUCCESS) {
 							SYSLOG("(%s) password for '%s' was changed.", pam_get_service(pamh), user);
-							PQclear(res);
+							replica_note_write(options, user);
+							badpass_forget(options, user);
 						}
-						PQfinish(conn);
+					}
+					if (conn) {
+						db_release(options, conn);
 					}
 					free (newpass_crypt);
 				} else {
@@ -239,7 +325,8 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 			}
 		}
 	}
-	//free_module_options(options);
+	trace_finish(options, rc);
+	free_mod_options(options);
 	if (flags & (PAM_PRELIM_CHECK | PAM_UPDATE_AUTHTOK))
 		return rc;
 	else
@@ -260,32 +347,48 @@ pam_sm_open_session(pam_handle_t *pamh, int flags,
 {
 	modopt_t *options = NULL;
 	const char *user, *rhost;
-	int rc;
+	int rc, result = PAM_SUCCESS;
 	PGresult *res;
 	PGconn *conn;
+	trace_time_t start;
 
+	trace_clock(&start);
 	user = NULL; rhost = NULL;
 
 	if ((options = mod_options(argc, argv)) != NULL) {
 
-		if (options->query_session_open) {
+		mod_options_service(options, pam_get_service(pamh));
+		trace_call(pamh, options, "pam_sm_open_session", &start);
+
+		if (options->query_session_open || options->max_sessions > 0 || options->session_sync_query) {
 
 			if ((rc = pam_get_item(pamh, PAM_RHOST, (const void **)&rhost)) == PAM_SUCCESS) {
 
 				if ((rc = pam_get_user(pamh, &user, NULL)) == PAM_SUCCESS) {
-					DBGLOG("Session opened for user: %s", user);
-					if ((conn = db_connect(options))) {
-						pg_execParam(conn, &res, options->query_session_open, pam_get_service(pamh), user, NULL, rhost);
+					mod_options_user(options, user);
+					mod_options_priority(options, user);
+					trace_attr(options, 0, "enduser.id", user);
+					/* a session we can't count would slip past max_sessions */
+					if ((options->max_sessions > 0 || options->session_sync_query) &&
+					    session_open(options, user) != PAM_SUCCESS && options->max_sessions > 0)
+						result = PAM_SESSION_ERR;
+					else
+						DBGLOG("Session opened for user: %s", user);
+					if (result == PAM_SUCCESS && options->query_session_open)
+						pg_locateUser(options, pam_get_service(pamh), user, rhost);
+					if (result == PAM_SUCCESS && options->query_session_open && (conn = db_connect(options))) {
+						pg_execParam(options, conn, &res, options->query_session_open, pam_get_service(pamh), user, NULL, rhost);
 						PQclear(res);
-						PQfinish(conn);
+						db_release(options, conn);
 					}
 				}
 			}
 		}
-	///free_module_options(options);
+		trace_finish(options, result);
+		free_mod_options(options);
 	}
 
-	return (PAM_SUCCESS);
+	return (result);
 
 }
 
@@ -298,26 +401,39 @@ pam_sm_close_session(pam_handle_t *pamh, int flags,
 	int rc;
 	PGresult *res;
 	PGconn *conn;
+	trace_time_t start;
 
+	trace_clock(&start);
 	user = NULL; rhost = NULL;
 
 	if ((options = mod_options(argc, argv)) != NULL) {
 
-		if (options->query_session_close) {
+		mod_options_service(options, pam_get_service(pamh));
+		trace_call(pamh, options, "pam_sm_close_session", &start);
+
+		if (options->query_session_close || options->max_sessions > 0 || options->session_sync_query) {
 
 			if ((rc = pam_get_item(pamh, PAM_RHOST, (const void **)&rhost)) == PAM_SUCCESS) {
 
 				if ((rc = pam_get_user(pamh, &user, NULL)) == PAM_SUCCESS) {
+					mod_options_user(options, user);
+					mod_options_priority(options, user);
+					trace_attr(options, 0, "enduser.id", user);
+					if (options->max_sessions > 0 || options->session_sync_query)
+						session_close(options, user);
 					DBGLOG("Session opened for user: %s", user);
-					if ((conn = db_connect(options))) {
-                          pg_execParam(conn, &res, options->query_session_close, pam_get_service(pamh), user, NULL, rhost);
+					if (options->query_session_close)
+						pg_locateUser(options, pam_get_service(pamh), user, rhost);
+					if (options->query_session_close && (conn = db_connect(options))) {
+                          pg_execParam(options, conn, &res, options->query_session_close, pam_get_service(pamh), user, NULL, rhost);
                           PQclear(res);
-                          PQfinish(conn);
+                          db_release(options, conn);
 					}
 				}
 			}
 		}
-	//free_module_options(options);
+		trace_finish(options, PAM_SUCCESS);
+		free_mod_options(options);
 	}
 
 	return (PAM_SUCCESS);
@@ -0,0 +1,408 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Asynchronous authentication, see pam_pgsql_async.h.  Every handle is a
+ * small state machine over a nonblocking libpq connection:
+ *
+ *	CONNECT -> [ROLE] -> AUTH -> [AFTER] -> DONE
+ *
+ * where ROLE switches a fresh session to the configured role and AFTER
+ * runs auth_succ_query or auth_fail_query.  Connections of finished
+ * handles are kept (up to pool_size per configuration) for the next ones.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <libpq-fe.h>
+
+#include "pam_pgsql.h"
+#include "pam_pgsql_async.h"
+
+#if SUPPORT_ATTRIBUTE_VISIBILITY_DEFAULT
+# define PGAUTH_VISIBLE __attribute__((visibility("default")))
+#else
+# define PGAUTH_VISIBLE
+#endif
+
+#define PGAUTH_DEFAULT_TIMEOUT  30
+
+enum pgauth_state {
+	ST_CONNECT,
+	ST_ROLE,
+	ST_AUTH,
+	ST_AFTER,
+	ST_DONE
+};
+
+struct idle_conn {
+	const char *connstr;
+	PGconn *conn;
+	struct idle_conn *next;
+};
+
+struct pgauth_config_s {
+	modopt_t *options;
+	struct idle_conn *idle;
+	int nidle;
+};
+
+struct pgauth_s {
+	pgauth_config_t *cfg;
+	enum pgauth_state state;
+	PGconn *conn;
+	const char *connstr;
+	PostgresPollingStatusType polling;
+	int sending;		/* query not completely flushed yet */
+	int reused;		/* conn was an idle one */
+	time_t deadline;
+	int rc;
+	char *service, *user, *passwd, *rhost;
+};
+
+PGAUTH_VISIBLE pgauth_config_t *
+pgauth_config(const char *config_file, const char *service)
+{
+	pgauth_config_t *cfg;
+	char *arg;
+	const char *argv[1];
+
+	arg = malloc(strlen(config_file) + 13);
+	sprintf(arg, "config_file=%s", config_file);
+	argv[0] = arg;
+
+	cfg = calloc(1, sizeof(pgauth_config_t));
+	cfg->options = mod_options(1, argv);
+	free(arg);
+	if (cfg->options == NULL) {
+		free(cfg);
+		return NULL;
+	}
+	mod_options_service(cfg->options, service);
+	db_connstr(cfg->options);
+	return cfg;
+}
+
+PGAUTH_VISIBLE void
+pgauth_config_free(pgauth_config_t *cfg)
+{
+	struct idle_conn *ic;
+
+	if (cfg == NULL)
+		return;
+	while ((ic = cfg->idle) != NULL) {
+		cfg->idle = ic->next;
+		PQfinish(ic->conn);
+		free(ic);
+	}
+	free_mod_options(cfg->options);
+	free(cfg);
+}
+
+/* private: finish the handle with rc, keeping the connection if it is reusable */
+static int
+pgauth_finish(pgauth_t *a, int rc)
+{
+	struct idle_conn *ic;
+
+	a->rc = rc;
+	a->state = ST_DONE;
+	if (a->conn == NULL)
+		return PGAUTH_DONE;
+
+	if (a->cfg->nidle < a->cfg->options->pool_size && !a->sending &&
+	    PQstatus(a->conn) == CONNECTION_OK && PQtransactionStatus(a->conn) == PQTRANS_IDLE) {
+		ic = malloc(sizeof(struct idle_conn));
+		ic->connstr = a->connstr;
+		ic->conn = a->conn;
+		ic->next = a->cfg->idle;
+		a->cfg->idle = ic;
+		a->cfg->nidle++;
+	} else {
+		PQfinish(a->conn);
+	}
+	a->conn = NULL;
+	return PGAUTH_DONE;
+}
+
+/* private: start sending query; PAM_SUCCESS or a PAM error */
+static int
+pgauth_send(pgauth_t *a, const char *query, const char *passwd)
+{
+	modopt_t *options = a->cfg->options;
+	struct pg_query q;
+	int ok;
+
+	if (query_prepare(options, &q, query, a->service, a->user, passwd, a->rhost) != PAM_SUCCESS)
+		return PAM_AUTH_ERR;
+	ok = PQsendQueryParams(a->conn, q.command, q.nparm, 0, q.values, 0, 0, 0);
+	query_free(&q);
+	if (!ok) {
+		SYSLOG("PostgreSQL query failed: '%s'", PQerrorMessage(a->conn));
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	a->sending = 1;
+	return PAM_SUCCESS;
+}
+
+/*
+ * private: move the current query along; 1 and *res set (possibly to an
+ * error result) when it is complete, 0 while it still is on the wire,
+ * -1 if the connection failed.
+ */
+static int
+pgauth_io(pgauth_t *a, PGresult **res)
+{
+	PGresult *r;
+
+	*res = NULL;
+	if (a->sending) {
+		switch (PQflush(a->conn)) {
+			case 0: a->sending = 0; break;
+			case 1: return 0;
+			default: return -1;
+		}
+	}
+	if (!PQconsumeInput(a->conn))
+		return -1;
+	if (PQisBusy(a->conn))
+		return 0;
+
+	/* keep the first result, throw away the rest */
+	while ((r = PQgetResult(a->conn)) != NULL) {
+		if (*res == NULL)
+			*res = r;
+		else
+			PQclear(r);
+	}
+	return *res != NULL ? 1 : -1;
+}
+
+/* private: start connecting anew */
+static int
+pgauth_connect(pgauth_t *a)
+{
+	a->conn = PQconnectStart(a->connstr);
+	if (a->conn == NULL || PQstatus(a->conn) == CONNECTION_BAD) {
+		SYSLOG("PostgreSQL connection failed: '%s'", a->conn ? PQerrorMessage(a->conn) : "out of memory");
+		return pgauth_finish(a, PAM_AUTHINFO_UNAVAIL);
+	}
+	a->state = ST_CONNECT;
+	a->polling = PGRES_POLLING_WRITING;
+	return PGAUTH_PENDING;
+}
+
+PGAUTH_VISIBLE pgauth_t *
+pgauth_start(pgauth_config_t *cfg, const char *service, const char *user, const char *passwd, const char *rhost)
+{
+	modopt_t *options = cfg->options;
+	struct idle_conn *ic, **pic;
+	pgauth_t *a;
+
+	a = calloc(1, sizeof(pgauth_t));
+	a->cfg = cfg;
+	if (user == NULL) {
+		pgauth_finish(a, PAM_USER_UNKNOWN);
+		return a;
+	}
+	a->service = service ? strdup(service) : NULL;
+	a->user = strdup(user);
+	a->passwd = strdup(passwd ? passwd : "");
+	a->rhost = rhost ? strdup(rhost) : NULL;
+	a->deadline = time(NULL) + (options->timeout ? atoi(options->timeout) : PGAUTH_DEFAULT_TIMEOUT);
+	a->connstr = options->nshards > 0 ?
+		options->shards[mod_options_shard(user, options->nshards)] : options->connstr;
+
+	if (backend_client_allowed(options, rhost) != PAM_SUCCESS) {
+		pgauth_finish(a, PAM_AUTH_ERR);
+		return a;
+	}
+
+	/* reuse a connection to the same database if we have one that is still up */
+	for (pic = &cfg->idle; (ic = *pic) != NULL; ) {
+		if (strcmp(ic->connstr, a->connstr)) {
+			pic = &ic->next;
+			continue;
+		}
+		*pic = ic->next;
+		cfg->nidle--;
+		a->conn = ic->conn;
+		free(ic);
+		if (PQconsumeInput(a->conn) && PQstatus(a->conn) == CONNECTION_OK)
+			break;
+		PQfinish(a->conn);
+		a->conn = NULL;
+	}
+	if (a->conn != NULL) {
+		a->reused = 1;
+		a->state = ST_AUTH;
+		if ((a->rc = pgauth_send(a, options->query_auth, a->passwd)) == PAM_SUCCESS)
+			return a;
+		if (a->rc != PAM_AUTHINFO_UNAVAIL) {
+			pgauth_finish(a, a->rc);
+			return a;
+		}
+		PQfinish(a->conn);
+		a->conn = NULL;
+	}
+
+	pgauth_connect(a);
+	return a;
+}
+
+PGAUTH_VISIBLE int
+pgauth_fd(pgauth_t *a)
+{
+	return a->conn ? PQsocket(a->conn) : -1;
+}
+
+PGAUTH_VISIBLE int
+pgauth_events(pgauth_t *a)
+{
+	if (a->state == ST_DONE)
+		return 0;
+	if (a->state == ST_CONNECT)
+		return a->polling == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+	return a->sending ? (POLLIN | POLLOUT) : POLLIN;
+}
+
+PGAUTH_VISIBLE long
+pgauth_timeout(pgauth_t *a)
+{
+	time_t now = time(NULL);
+
+	if (a->state == ST_DONE)
+		return 0;
+	return a->deadline > now ? (a->deadline - now) * 1000 : 0;
+}
+
+PGAUTH_VISIBLE int
+pgauth_step(pgauth_t *a)
+{
+	modopt_t *options = a->cfg->options;
+	PGresult *res;
+	const char *after;
+	char *command, *ident;
+	int rc;
+
+	if (a->state == ST_DONE)
+		return PGAUTH_DONE;
+	if (time(NULL) >= a->deadline) {
+		SYSLOG("authentication of %s timed out", a->user);
+		return pgauth_finish(a, a->state == ST_AFTER ? a->rc : PAM_AUTHINFO_UNAVAIL);
+	}
+
+	switch (a->state) {
+		case ST_CONNECT:
+			a->polling = PQconnectPoll(a->conn);
+			if (a->polling == PGRES_POLLING_FAILED) {
+				SYSLOG("PostgreSQL connection failed: '%s'", PQerrorMessage(a->conn));
+				return pgauth_finish(a, PAM_AUTHINFO_UNAVAIL);
+			}
+			if (a->polling != PGRES_POLLING_OK)
+				return PGAUTH_PENDING;
+
+			PQsetnonblocking(a->conn, 1);
+			if (options->role != NULL) {
+				if ((ident = PQescapeIdentifier(a->conn, options->role, strlen(options->role))) == NULL)
+					return pgauth_finish(a, PAM_BUF_ERR);
+				command = malloc(strlen(ident) + 10);
+				sprintf(command, "SET ROLE %s", ident);
+				PQfreemem(ident);
+				rc = PQsendQuery(a->conn, command);
+				free(command);
+				if (!rc)
+					return pgauth_finish(a, PAM_AUTHINFO_UNAVAIL);
+				a->sending = 1;
+				a->state = ST_ROLE;
+				return PGAUTH_PENDING;
+			}
+			a->state = ST_AUTH;
+			if ((rc = pgauth_send(a, options->query_auth, a->passwd)) != PAM_SUCCESS)
+				return pgauth_finish(a, rc);
+			return PGAUTH_PENDING;
+
+		case ST_ROLE:
+			if ((rc = pgauth_io(a, &res)) == 0)
+				return PGAUTH_PENDING;
+			if (rc < 0 || PQresultStatus(res) != PGRES_COMMAND_OK) {
+				SYSLOG("could not switch to role %s", options->role);
+				PQclear(res);
+				return pgauth_finish(a, PAM_AUTHINFO_UNAVAIL);
+			}
+			PQclear(res);
+			a->state = ST_AUTH;
+			if ((rc = pgauth_send(a, options->query_auth, a->passwd)) != PAM_SUCCESS)
+				return pgauth_finish(a, rc);
+			return PGAUTH_PENDING;
+
+		case ST_AUTH:
+			if ((rc = pgauth_io(a, &res)) == 0)
+				return PGAUTH_PENDING;
+			if (rc < 0 && a->reused) {
+				/* the server dropped the idle session meanwhile, auth_query only reads */
+				DBGLOG("reused connection went away, reconnecting");
+				PQfinish(a->conn);
+				a->conn = NULL;
+				a->sending = 0;
+				a->reused = 0;
+				return pgauth_connect(a);
+			}
+			if (rc < 0) {
+				SYSLOG("PostgreSQL connection failed: '%s'", PQerrorMessage(a->conn));
+				return pgauth_finish(a, PAM_AUTHINFO_UNAVAIL);
+			}
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+				SYSLOG("PostgreSQL query failed: '%s'", PQresultErrorMessage(res));
+				PQclear(res);
+				return pgauth_finish(a, PAM_AUTH_ERR);
+			}
+			a->rc = backend_verify(options, a->user, a->passwd, res);
+			PQclear(res);
+			/* as with PAM_DISALLOW_NULL_AUTHTOK, there is no flag to relax it */
+			if (a->rc == PAM_SUCCESS && *a->passwd == '\0')
+				a->rc = PAM_AUTH_ERR;
+
+			after = a->rc == PAM_SUCCESS ? options->query_auth_succ : options->query_auth_fail;
+			if (after == NULL || pgauth_send(a, after, a->passwd) != PAM_SUCCESS)
+				return pgauth_finish(a, a->rc);
+			a->state = ST_AFTER;
+			return PGAUTH_PENDING;
+
+		case ST_AFTER:
+			if ((rc = pgauth_io(a, &res)) == 0)
+				return PGAUTH_PENDING;
+			PQclear(res);
+			return pgauth_finish(a, a->rc);
+
+		default:
+			return PGAUTH_DONE;
+	}
+}
+
+PGAUTH_VISIBLE int
+pgauth_result(pgauth_t *a)
+{
+	return a->state == ST_DONE ? a->rc : PAM_AUTHINFO_UNAVAIL;
+}
+
+PGAUTH_VISIBLE void
+pgauth_free(pgauth_t *a)
+{
+	if (a == NULL)
+		return;
+	if (a->conn != NULL)
+		PQfinish(a->conn);
+	free(a->service);
+	free(a->user);
+	if (a->passwd != NULL) {
+		memset(a->passwd, 0, strlen(a->passwd));
+		free(a->passwd);
+	}
+	free(a->rhost);
+	free(a);
+}
@@ -0,0 +1,41 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Asynchronous interface to the authentication backend, for programs
+ * that drive many logins from one event loop instead of blocking a
+ * thread (or a process) per login in the PAM API.
+ *
+ *	cfg = pgauth_config("/etc/pam_pgsql.conf", "imap");
+ *	a = pgauth_start(cfg, "imap", user, password, rhost);
+ *	while (pgauth_step(a) == PGAUTH_PENDING)
+ *		wait for pgauth_events(a) on pgauth_fd(a),
+ *		at most pgauth_timeout(a) milliseconds;
+ *	rc = pgauth_result(a);		(a PAM return code)
+ *	pgauth_free(a);
+ *
+ * A configuration and the handles started from it must be used from a
+ * single thread.  Password hashing is done inside pgauth_step(), and
+ * resolving a host name for %i or %n may block.
+ */
+
+#ifndef __PAM_PGSQL_ASYNC_H
+#define __PAM_PGSQL_ASYNC_H
+
+#define PGAUTH_PENDING  0
+#define PGAUTH_DONE     1
+
+typedef struct pgauth_config_s pgauth_config_t;
+typedef struct pgauth_s pgauth_t;
+
+pgauth_config_t * pgauth_config(const char *config_file, const char *service);
+void pgauth_config_free(pgauth_config_t *cfg);
+
+pgauth_t * pgauth_start(pgauth_config_t *cfg, const char *service, const char *user, const char *passwd, const char *rhost);
+int pgauth_fd(pgauth_t *a);
+int pgauth_events(pgauth_t *a);
+long pgauth_timeout(pgauth_t *a);
+int pgauth_step(pgauth_t *a);
+int pgauth_result(pgauth_t *a);
+void pgauth_free(pgauth_t *a);
+
+#endif
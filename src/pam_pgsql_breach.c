@@ -0,0 +1,204 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Builds the breached password index used by breach_file, see breach.c.
+ * The input has one SHA-1 in hex per line, optionally followed by ":"
+ * and anything else (the format of the usual downloadable corpora), or
+ * with -p one clear text password per line.  Input that is already
+ * sorted is streamed into the index, anything else is sorted in place
+ * in the output file afterwards, so memory use doesn't grow with the
+ * corpus.  The index is written next to the output and renamed over it,
+ * running processes pick it up with the next check.
+ *
+ *	pam_pgsql_breach [-p] index [corpus ...]
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <gcrypt.h>
+
+#include <security/pam_appl.h>
+
+#include "breach.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: pam_pgsql_breach [-p] index [corpus ...]\n");
+	exit(1);
+}
+
+static void
+put_be64(unsigned char *p, unsigned long long v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static int
+cmp_hash(const void *a, const void *b)
+{
+	return memcmp(a, b, BREACH_HASHLEN);
+}
+
+/* private: 40 hex digits at the start of line, 0 if there aren't */
+static int
+parse_hash(const char *line, unsigned char *hash)
+{
+	int i, hi, lo;
+
+	for (i = 0; i < BREACH_HASHLEN; i++) {
+		if (!isxdigit((unsigned char) line[2 * i]) || !isxdigit((unsigned char) line[2 * i + 1]))
+			return 0;
+		hi = tolower((unsigned char) line[2 * i]);
+		lo = tolower((unsigned char) line[2 * i + 1]);
+		hash[i] = ((isdigit(hi) ? hi - '0' : hi - 'a' + 10) << 4) | (isdigit(lo) ? lo - '0' : lo - 'a' + 10);
+	}
+	return line[2 * BREACH_HASHLEN] == '\0' || line[2 * BREACH_HASHLEN] == ':' ||
+	    isspace((unsigned char) line[2 * BREACH_HASHLEN]);
+}
+
+/* private: append the hashes of one corpus file to out */
+static void
+read_corpus(FILE *in, const char *name, FILE *out, int clear, unsigned char *prev,
+    unsigned long long *count, int *sorted)
+{
+	char *line = NULL;
+	unsigned char hash[BREACH_HASHLEN];
+	unsigned long long lineno = 0, bad = 0;
+	size_t size = 0;
+	ssize_t len;
+	int c;
+
+	/* lines of any length, a long password is hashed whole */
+	while ((len = getline(&line, &size, in)) >= 0) {
+		lineno++;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (clear)
+			gcry_md_hash_buffer(GCRY_MD_SHA1, hash, line, len);
+		else if (!parse_hash(line, hash)) {
+			if (bad++ < 10)
+				fprintf(stderr, "%s:%llu: not a SHA-1 hash, skipped\n", name, lineno);
+			continue;
+		}
+
+		/* duplicates next to each other are dropped right away */
+		c = *count ? memcmp(prev, hash, BREACH_HASHLEN) : -1;
+		if (c == 0)
+			continue;
+		if (c > 0)
+			*sorted = 0;
+		if (fwrite(hash, BREACH_HASHLEN, 1, out) != 1) {
+			perror("pam_pgsql_breach: write");
+			exit(1);
+		}
+		memcpy(prev, hash, BREACH_HASHLEN);
+		(*count)++;
+	}
+	free(line);
+	if (bad)
+		fprintf(stderr, "%s: %llu lines skipped\n", name, bad);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char prev[BREACH_HASHLEN], *map, *records, *header;
+	unsigned long long count = 0, n, i, bucket;
+	off_t size;
+	char *tmp;
+	FILE *out, *in;
+	int opt, clear = 0, sorted = 1, fd, arg;
+
+	while ((opt = getopt(argc, argv, "p")) != -1) {
+		switch (opt) {
+			case 'p': clear = 1; break;
+			default: usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	tmp = malloc(strlen(argv[optind]) + 5);
+	sprintf(tmp, "%s.tmp", argv[optind]);
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || (out = fdopen(fd, "w+")) == NULL) {
+		perror(tmp);
+		return 1;
+	}
+
+	/* header and fan-out table are filled in at the end */
+	if (fseeko(out, BREACH_RECORDS, SEEK_SET) != 0) {
+		perror(tmp);
+		return 1;
+	}
+	if (optind + 1 == argc) {
+		read_corpus(stdin, "stdin", out, clear, prev, &count, &sorted);
+	} else {
+		for (arg = optind + 1; arg < argc; arg++) {
+			if ((in = fopen(argv[arg], "r")) == NULL) {
+				perror(argv[arg]);
+				return 1;
+			}
+			read_corpus(in, argv[arg], out, clear, prev, &count, &sorted);
+			fclose(in);
+		}
+	}
+	size = BREACH_RECORDS + count * BREACH_HASHLEN;
+	if (fflush(out) != 0 || ftruncate(fd, size) != 0) {
+		perror(tmp);
+		return 1;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("pam_pgsql_breach: mmap");
+		return 1;
+	}
+	records = map + BREACH_RECORDS;
+
+	if (!sorted) {
+		fprintf(stderr, "sorting %llu hashes\n", count);
+		qsort(records, count, BREACH_HASHLEN, cmp_hash);
+		for (n = 0, i = 0; i < count; i++)
+			if (n == 0 || memcmp(records + (n - 1) * BREACH_HASHLEN, records + i * BREACH_HASHLEN, BREACH_HASHLEN))
+				memmove(records + n++ * BREACH_HASHLEN, records + i * BREACH_HASHLEN, BREACH_HASHLEN);
+		count = n;
+	}
+
+	/* end of every bucket */
+	header = map;
+	memcpy(header, BREACH_MAGIC, 8);
+	put_be64(header + 8, count);
+	for (bucket = 0, i = 0; bucket < BREACH_FANOUT; bucket++) {
+		while (i < count && ((records[i * BREACH_HASHLEN] << 8) | records[i * BREACH_HASHLEN + 1]) == bucket)
+			i++;
+		put_be64(header + 16 + 8 * bucket, i);
+	}
+
+	if (msync(map, size, MS_SYNC) != 0 ||
+	    ftruncate(fd, BREACH_RECORDS + count * BREACH_HASHLEN) != 0 || fsync(fd) != 0) {
+		perror(tmp);
+		return 1;
+	}
+	munmap(map, size);
+	fclose(out);
+
+	if (rename(tmp, argv[optind]) != 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	printf("%llu hashes written to %s\n", count, argv[optind]);
+	return 0;
+}
@@ -0,0 +1,403 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Authentication helper for programs that don't talk PAM, for instance
+ * Squid basic auth (with or without concurrency) or nginx auth_request
+ * through a small local service.  Requests are lines of
+ *
+ *	[id] user password [rhost]
+ *
+ * with every field %XX url-escaped, answers are "[id] OK" or "[id] ERR".
+ * The channel id is only there with -C (Squid's concurrency); then any
+ * number of requests of a client may be in flight at the same time and
+ * the answers come back out of order, otherwise a client's requests are
+ * answered one after the other.  Requests are read from stdin, or from
+ * clients of a Unix socket given with -l.  Socket clients are written
+ * without blocking; one that lets HELPER_OUT bytes of answers pile up
+ * is dropped so that it can't stall the others.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include <security/pam_appl.h>
+
+#include "pam_pgsql_async.h"
+#include "pam_pgsql_options.h"
+
+#define HELPER_LINE      4096
+#define HELPER_MAX       1024
+#define HELPER_MAX_ID    32
+#define HELPER_OUT       65536
+
+struct client {
+	int in, out;
+	char buf[HELPER_LINE];
+	size_t len;
+	char obuf[HELPER_OUT];	/* answers not written yet */
+	size_t olen;
+	int eof;
+	int dead;		/* dropped, answers are thrown away */
+	int pending;
+	struct client *next;
+};
+
+struct request {
+	pgauth_t *a;
+	struct client *c;
+	char *id;
+	struct request *next;
+};
+
+static struct client *clients = NULL;
+static struct request *requests = NULL;
+static int nclients = 0, nrequests = 0;
+static int concurrent = 0;
+
+/* private: undo %XX escapes in place */
+static void
+url_unescape(char *s)
+{
+	char *d = s, hex[3] = { 0, 0, 0 };
+
+	for (; *s; s++) {
+		if (*s == '%' && isxdigit((unsigned char) s[1]) && isxdigit((unsigned char) s[2])) {
+			hex[0] = s[1];
+			hex[1] = s[2];
+			*d++ = (char) strtol(hex, NULL, 16);
+			s += 2;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+}
+
+static void
+drop(struct client *c)
+{
+	c->eof = c->dead = 1;
+	c->olen = 0;
+}
+
+/* private: write as much of the queued answers as the client takes */
+static void
+flush(struct client *c)
+{
+	ssize_t n;
+
+	while (c->olen > 0) {
+		if ((n = write(c->out, c->obuf, c->olen)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				drop(c);
+			return;
+		}
+		c->olen -= n;
+		memmove(c->obuf, c->obuf + n, c->olen);
+	}
+}
+
+static void
+reply(struct client *c, const char *id, const char *answer)
+{
+	char line[128];
+	int len;
+
+	if (c->dead)
+		return;
+	len = snprintf(line, sizeof(line), "%s%s%s\n", id ? id : "", id ? " " : "", answer);
+	if (len < 0 || len >= (int) sizeof(line))
+		len = sizeof(line) - 1;
+	if (c->olen + len > sizeof(c->obuf)) {
+		fprintf(stderr, "client doesn't read its answers, dropped\n");
+		drop(c);
+		return;
+	}
+	memcpy(c->obuf + c->olen, line, len);
+	c->olen += len;
+	flush(c);
+}
+
+static void
+finish(struct request *r)
+{
+	reply(r->c, r->id, pgauth_result(r->a) == PAM_SUCCESS ? "OK" : "ERR");
+	r->c->pending--;
+	pgauth_free(r->a);
+	free(r->id);
+	free(r);
+	nrequests--;
+}
+
+/* private: one request line from a client */
+static void
+handle_line(pgauth_config_t *cfg, const char *service, struct client *c, char *line)
+{
+	struct request *r;
+	char *field[4], *id = NULL;
+	int n = 0;
+
+	for (n = 0; n < 4 && (field[n] = strtok(n ? NULL : line, " \t\r")) != NULL; n++);
+
+	/* with -C every request starts with the channel id */
+	if (concurrent) {
+		if (n == 0 || strlen(field[0]) > HELPER_MAX_ID ||
+		    field[0][strspn(field[0], "0123456789")] != '\0') {
+			reply(c, NULL, "ERR");
+			return;
+		}
+		id = field[0];
+		memmove(field, field + 1, 3 * sizeof(char *));
+		n--;
+		if (n == 3 && (field[3] = strtok(NULL, " \t\r")) != NULL)
+			n = 4;
+	}
+	if (n < 2) {
+		reply(c, id, "ERR");
+		return;
+	}
+	url_unescape(field[0]);
+	url_unescape(field[1]);
+	if (n > 2)
+		url_unescape(field[2]);
+
+	r = calloc(1, sizeof(struct request));
+	r->c = c;
+	r->id = id ? strdup(id) : NULL;
+	r->a = pgauth_start(cfg, service, field[0], field[1], n > 2 ? field[2] : NULL);
+	memset(field[1], 0, strlen(field[1]));
+	c->pending++;
+	nrequests++;
+
+	if (pgauth_step(r->a) == PGAUTH_DONE) {
+		finish(r);
+	} else {
+		r->next = requests;
+		requests = r;
+	}
+}
+
+/* private: start the complete lines the client sent, one at a time without -C */
+static void
+handle_lines(pgauth_config_t *cfg, const char *service, struct client *c)
+{
+	char *nl, *start;
+
+	for (start = c->buf; !c->dead && (concurrent || c->pending == 0) &&
+	     (nl = memchr(start, '\n', c->len - (start - c->buf))) != NULL; start = nl + 1) {
+		*nl = '\0';
+		handle_line(cfg, service, c, start);
+	}
+	c->len -= start - c->buf;
+	memmove(c->buf, start, c->len);
+
+	if (c->len == sizeof(c->buf) - 1 && memchr(c->buf, '\n', c->len) == NULL) {
+		/* a line that long isn't a request */
+		c->len = 0;
+		reply(c, NULL, "ERR");
+	}
+}
+
+/* private: read what the client sent */
+static void
+handle_input(pgauth_config_t *cfg, const char *service, struct client *c)
+{
+	ssize_t n;
+
+	n = read(c->in, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+	if (n <= 0) {
+		if (n == 0 || (errno != EINTR && errno != EAGAIN))
+			c->eof = 1;
+		return;
+	}
+	c->len += n;
+	c->buf[c->len] = '\0';
+	handle_lines(cfg, service, c);
+}
+
+/* private: may we read more from the client now? */
+static int
+reading(struct client *c)
+{
+	/* without -C the next request waits for the answer to this one */
+	return !c->eof && nrequests < HELPER_MAX && (concurrent || c->pending == 0);
+}
+
+static struct client *
+add_client(int in, int out)
+{
+	struct client *c;
+
+	c = calloc(1, sizeof(struct client));
+	c->in = in;
+	c->out = out;
+	c->next = clients;
+	clients = c;
+	nclients++;
+	return c;
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+	    chmod(path, 0660) != 0 || listen(fd, 64) != 0) {
+		perror(path);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: pam_pgsql_helper [-C] [-c config_file] [-s service] [-l socket]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	pgauth_config_t *cfg;
+	struct client *c, **pc;
+	struct request *r, **pr;
+	struct pollfd *pfd = NULL;
+	const char *config = PAM_PGSQL_FILECONF, *service = "pam_pgsql_helper", *sock = NULL;
+	int opt, i, n, lfd = -1, fd, accepting;
+	long timeout, t;
+
+	while ((opt = getopt(argc, argv, "Cc:s:l:")) != -1) {
+		switch (opt) {
+			case 'C': concurrent = 1; break;
+			case 'c': config = optarg; break;
+			case 's': service = optarg; break;
+			case 'l': sock = optarg; break;
+			default: usage();
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((cfg = pgauth_config(config, service)) == NULL) {
+		fprintf(stderr, "can't load %s\n", config);
+		return 1;
+	}
+
+	if (sock != NULL) {
+		if ((lfd = listen_on(sock)) < 0)
+			return 1;
+	} else {
+		add_client(0, 1);
+		setvbuf(stdout, NULL, _IONBF, 0);
+	}
+
+	for (;;) {
+		/* drop the clients that are gone and got all of their answers */
+		for (pc = &clients; (c = *pc) != NULL; ) {
+			if (c->eof && c->pending == 0 && c->olen == 0) {
+				*pc = c->next;
+				if (c->in != 0) {
+					close(c->in);
+				}
+				free(c);
+				nclients--;
+			} else {
+				pc = &c->next;
+			}
+		}
+		if (lfd < 0 && clients == NULL && requests == NULL)
+			break;
+
+		pfd = realloc(pfd, (1 + nrequests + nclients) * sizeof(struct pollfd));
+		n = 0;
+		timeout = -1;
+		if (lfd >= 0) {
+			pfd[n].fd = lfd;
+			pfd[n++].events = POLLIN;
+		}
+		for (r = requests; r != NULL; r = r->next) {
+			pfd[n].fd = pgauth_fd(r->a);
+			pfd[n++].events = pgauth_events(r->a);
+			t = pgauth_timeout(r->a);
+			if (timeout < 0 || t < timeout)
+				timeout = t;
+		}
+		/* stop reading while we have as much on our plate as we want */
+		for (c = clients; c != NULL; c = c->next) {
+			pfd[n].fd = c->in;
+			pfd[n].events = reading(c) ? POLLIN : 0;
+			if (c->olen > 0)
+				pfd[n].events |= POLLOUT;
+			if (pfd[n].events == 0)
+				pfd[n].fd = -1;
+			n++;
+		}
+		for (i = 0; i < n; i++)
+			pfd[i].revents = 0;
+
+		if (poll(pfd, n, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		/* a new client goes in front of the list, take it once we are through */
+		i = 0;
+		accepting = lfd >= 0 && (pfd[i++].revents & POLLIN);
+
+		for (pr = &requests; (r = *pr) != NULL; i++) {
+			if ((pfd[i].revents || pgauth_timeout(r->a) == 0) && pgauth_step(r->a) == PGAUTH_DONE) {
+				*pr = r->next;
+				finish(r);
+			} else {
+				pr = &r->next;
+			}
+		}
+
+		for (c = clients; c != NULL; c = c->next, i++) {
+			if (pfd[i].revents & POLLOUT)
+				flush(c);
+			if ((pfd[i].events & POLLIN) && (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				handle_input(cfg, service, c);
+			else if (pfd[i].revents & (POLLHUP | POLLERR))
+				drop(c);
+			/* requests held back until the previous one was answered */
+			if (!concurrent && c->pending == 0 && c->len > 0)
+				handle_lines(cfg, service, c);
+		}
+
+		if (accepting && (fd = accept(lfd, NULL, NULL)) >= 0) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			add_client(fd, fd);
+		}
+	}
+
+	free(pfd);
+	pgauth_config_free(cfg);
+	return 0;
+}
@@ -15,16 +15,669 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
 
 #include "pam_pgsql.h"
 #include "pam_pgsql_options.h"
 
+/* private: replace a string option with a copy of another one */
+static void
+override_str(char **dst, const char *src) {
+
+    if(src == NULL)
+        return;
+    free(*dst);
+    *dst = strdup(src);
+}
+
+/* private: set a batch query, which has nowhere to put its rows without %V */
+static void
+set_batch_query(char **dst, const char *key, const char *val) {
+
+    if(val != NULL && strstr(val, "%V") == NULL) {
+        SYSLOG("%s without %%V ignored", key);
+        return;
+    }
+    override_str(dst, val);
+}
+
+/*
+ * Options mod_options_service() takes from a [backend] section.  The
+ * others (default queries built from table and columns, caches, tracing,
+ * priority, background intervals) are per process or decided before the
+ * service is routed, and are only read outside of any section.
+ */
+static const char *backend_keys[] = {
+    "connect", "database", "host", "port", "user", "password", "sslmode",
+    "timeout", "role", "auth_query", "auth_succ_query", "auth_fail_query",
+    "auth_succ_batch_query", "auth_fail_batch_query", "acct_query",
+    "pwd_query", "session_open_query", "session_close_query",
+    "history_query", "history_update_query", "user_filter", "breach_file",
+    "network_file", "allow_from", "deny_from", "shard", "shard_previous",
+    "replica", "replica_max_lag", "replica_ryw_window", "hedge_percentile",
+    "hedge_max_rate", "pw_type", "target_hash_ms", "pool_size",
+    "pool_reserved", "pool_idle_timeout", "admission_timeout",
+    "max_sessions", "coalesce_queries", "wrong_password_ttl", NULL
+};
+
+/* private: may key be set in a [backend] section? */
+static int
+backend_key(const char *key) {
+
+    int i;
+
+    for(i = 0; backend_keys[i] != NULL; i++)
+        if(!strcmp(backend_keys[i], key))
+            return 1;
+    return 0;
+}
+
+/* private: set a single configuration file option */
+static void
+set_option(modopt_t *options, const char *key, char *val) {
+
+    if(!strcmp(key, "auth_query")) {
+        override_str(&options->query_auth, val);
+    } else if( strcmp(key, "connect") == 0 ) {
+        override_str(&options->connstr, val);
+    } else if(!strcmp(key, "auth_succ_query")) {
+        override_str(&options->query_auth_succ, val);
+    } else if(!strcmp(key, "auth_fail_query")) {
+        override_str(&options->query_auth_fail, val);
+    } else if(!strcmp(key, "auth_succ_batch_query")) {
+        set_batch_query(&options->query_auth_succ_batch, key, val);
+    } else if(!strcmp(key, "auth_fail_batch_query")) {
+        set_batch_query(&options->query_auth_fail_batch, key, val);
+    } else if(!strcmp(key, "write_behind_interval")) {
+        options->write_behind_interval = atoi(val);
+    } else if(!strcmp(key, "acct_query")) {
+        override_str(&options->query_acct, val);
+    } else if(!strcmp(key, "pwd_query")) {
+        override_str(&options->query_pwd, val);
+    } else if(!strcmp(key, "session_open_query")) {
+        override_str(&options->query_session_open, val);
+    } else if(!strcmp(key, "session_close_query")) {
+        override_str(&options->query_session_close, val);
+    } else if(!strcmp(key, "session_sync_query")) {
+        override_str(&options->session_sync_query, val);
+    } else if(!strcmp(key, "session_sync_interval")) {
+        options->session_sync_interval = atoi(val);
+    } else if(!strcmp(key, "max_sessions")) {
+        options->max_sessions = atoi(val);
+    } else if(!strcmp(key, "history_query")) {
+        override_str(&options->history_query, val);
+    } else if(!strcmp(key, "history_update_query")) {
+        override_str(&options->history_update_query, val);
+    } else if(!strcmp(key, "history_threads")) {
+        options->history_threads = atoi(val);
+    } else if(!strcmp(key, "wrong_password_ttl")) {
+        options->wrong_password_ttl = atoi(val);
+    } else if(!strcmp(key, "target_hash_ms")) {
+        options->target_hash_ms = atoi(val);
+    } else if(!strcmp(key, "user_filter")) {
+        override_str(&options->user_filter, val);
+    } else if(!strcmp(key, "breach_file")) {
+        override_str(&options->breach_file, val);
+    } else if(!strcmp(key, "database")) {
+        override_str(&options->db, val);
+    } else if(!strcmp(key, "table")) {
+        override_str(&options->table, val);
+    } else if(!strcmp(key, "host")) {
+        override_str(&options->host, val);
+    } else if(!strcmp(key, "port")) {
+        override_str(&options->port, val);
+    } else if(!strcmp(key, "timeout")) {
+        override_str(&options->timeout, val);
+    } else if(!strcmp(key, "user")) {
+        override_str(&options->user, val);
+    } else if(!strcmp(key, "sslmode")) {
+
+        /* If not a valid option */
+        if(strcmp(val, "require") != 0 && strcmp(val, "prefer") != 0 && strcmp(val, "allow") != 0 && strcmp(val,"disable") != 0) {
+            SYSLOG("sslmode \"%s\" is not a valid option! Falling back to \"prefer\".", val);
+            override_str(&options->sslmode, "prefer");
+        } else
+            override_str(&options->sslmode, val);
+    } else if(!strcmp(key, "role")) {
+        override_str(&options->role, val);
+    } else if(!strcmp(key, "password")) {
+        override_str(&options->passwd, val);
+    } else if(!strcmp(key, "user_column")) {
+        override_str(&options->column_user, val);
+    } else if(!strcmp(key, "pwd_column")) {
+        override_str(&options->column_pwd, val);
+    } else if(!strcmp(key, "expired_column")) {
+        override_str(&options->column_expired, val);
+    } else if(!strcmp(key, "newtok_column")) {
+        override_str(&options->column_newpwd, val);
+    } else if(!strcmp(key, "pw_type")) {
+        options->pw_type = PW_CLEAR;
+        if(!strcmp(val, "md5")) {
+            options->pw_type = PW_MD5;
+        } else if(!strcmp(val, "sha1")) {
+            options->pw_type = PW_SHA1;
+        } else if(!strcmp(val, "crypt")) {
+            options->pw_type = PW_CRYPT;
+        } else if(!strcmp(val, "crypt_md5")) {
+            options->pw_type = PW_CRYPT_MD5;
+        } else if(!strcmp(val, "crypt_sha512")) {
+            options->pw_type = PW_CRYPT_SHA512;
+        } else if(!strcmp(val, "md5_postgres")) {
+            options->pw_type = PW_MD5_POSTGRES;
+        } else if(!strcmp(val, "function")) {
+            options->pw_type = PW_FUNCTION;
+        }
+    } else if(!strcmp(key, "network_file")) {
+        override_str(&options->network_file, val);
+    } else if(!strcmp(key, "allow_from")) {
+        override_str(&options->allow_from, val);
+    } else if(!strcmp(key, "deny_from")) {
+        override_str(&options->deny_from, val);
+    } else if(!strcmp(key, "pool_size")) {
+        options->pool_size = atoi(val);
+    } else if(!strcmp(key, "pool_idle_timeout")) {
+        options->pool_idle_timeout = atoi(val);
+    } else if(!strcmp(key, "pool_reserved")) {
+        options->pool_reserved = atoi(val);
+    } else if(!strcmp(key, "admission_timeout")) {
+        options->admission_timeout = atoi(val);
+    } else if(!strcmp(key, "priority_users")) {
+        override_str(&options->priority_users, val);
+    } else if(!strcmp(key, "priority_groups")) {
+        override_str(&options->priority_groups, val);
+    } else if(!strcmp(key, "priority_services")) {
+        override_str(&options->priority_services, val);
+    } else if(!strcmp(key, "coalesce_queries")) {
+        options->coalesce_queries = atoi(val);
+    } else if(!strcmp(key, "dns_cache_ttl")) {
+        options->dns_cache_ttl = atoi(val);
+    } else if(!strcmp(key, "dns_negative_ttl")) {
+        options->dns_negative_ttl = atoi(val);
+    } else if(!strcmp(key, "heavy_hitters")) {
+        options->heavy_hitters = atoi(val);
+    } else if(!strcmp(key, "heavy_hitters_window")) {
+        options->heavy_hitters_window = atoi(val);
+    } else if(!strcmp(key, "trace_file")) {
+        override_str(&options->trace_file, val);
+    } else if(!strcmp(key, "trace_sample")) {
+        options->trace_sample = atoi(val);
+    } else if(!strcmp(key, "trace_file_size")) {
+        options->trace_file_size = atol(val);
+    } else if(!strcmp(key, "flight_recorder")) {
+        options->flight_recorder = atoi(val);
+    } else if(!strcmp(key, "phase_stats")) {
+        options->phase_stats = atoi(val);
+    } else if(!strcmp(key, "shard")) {
+        options->shards = realloc(options->shards, (options->nshards + 1) * sizeof(char *));
+        options->shards[options->nshards++] = strdup(val);
+    } else if(!strcmp(key, "replica")) {
+        options->replicas = realloc(options->replicas, (options->nreplicas + 1) * sizeof(char *));
+        options->replicas[options->nreplicas++] = strdup(val);
+    } else if(!strcmp(key, "replica_max_lag")) {
+        options->replica_max_lag = atoi(val);
+    } else if(!strcmp(key, "replica_ryw_window")) {
+        options->replica_ryw_window = atoi(val);
+    } else if(!strcmp(key, "hedge_percentile")) {
+        options->hedge_percentile = atoi(val);
+        if(options->hedge_percentile < 0 || options->hedge_percentile > 100) {
+            SYSLOG("hedge_percentile must be between 0 and 100, hedging disabled");
+            options->hedge_percentile = 0;
+        }
+    } else if(!strcmp(key, "hedge_max_rate")) {
+        options->hedge_max_rate = atoi(val);
+    } else if(!strcmp(key, "shard_previous")) {
+        options->shard_previous = atoi(val);
+    } else if(!strcmp(key, "debug")) {
+        options->debug = 1;
+    }
+
+}
+
+/* private: route = <service> <backend>, a later route for the same service wins */
+static void
+add_route(modopt_t *options, const char *val) {
+
+    char service[256], backend[256];
+    routes_t *r = &options->routes;
+    int i;
+
+    if(sscanf(val, "%255s %255s", service, backend) != 2) {
+        SYSLOG("bad route \"%s\", expected \"route = service backend\"", val);
+        return;
+    }
+
+    for(i = 0; i < r->nroutes; i++) {
+        if(!strcmp(r->service[i], service)) {
+            free(r->backend[i]);
+            r->backend[i] = strdup(backend);
+            return;
+        }
+    }
+
+    r->service = realloc(r->service, (r->nroutes + 1) * sizeof(char *));
+    r->backend = realloc(r->backend, (r->nroutes + 1) * sizeof(char *));
+    r->service[r->nroutes] = strdup(service);
+    r->backend[r->nroutes] = strdup(backend);
+    r->nroutes++;
+}
+
+/* private: seeded FNV-1a with a final mix, for the route perfect hash */
+static unsigned int
+route_hash(const char *s, unsigned int seed) {
+
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    while(*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+/*
+ * The configuration is read again on every call, so the last table built
+ * is kept and reused as long as the route services stay the same.
+ */
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+static routes_t routes_built;
+
+/* private: copy the hash of from into r, services and backends aside */
+static void
+copy_routes(routes_t *r, const routes_t *from) {
+
+    r->nslots = from->nslots;
+    r->nbuckets = from->nbuckets;
+    r->slots = malloc(r->nslots * sizeof(int));
+    r->disp = malloc(r->nbuckets * sizeof(unsigned int));
+    memcpy(r->slots, from->slots, r->nslots * sizeof(int));
+    memcpy(r->disp, from->disp, r->nbuckets * sizeof(unsigned int));
+}
+
+/* private: do a and b route the same services, in the same order? */
+static int
+same_routes(const routes_t *a, const routes_t *b) {
+
+    int i;
+
+    if(a->nroutes != b->nroutes)
+        return 0;
+    for(i = 0; i < a->nroutes; i++)
+        if(strcmp(a->service[i], b->service[i]))
+            return 0;
+    return 1;
+}
+
+/* private: remember r as the last table built, called with routes_lock held */
+static void
+keep_routes(const routes_t *r) {
+
+    int i;
+
+    for(i = 0; i < routes_built.nroutes; i++)
+        free(routes_built.service[i]);
+    free(routes_built.service);
+    free(routes_built.slots);
+    free(routes_built.disp);
+
+    routes_built.service = malloc(r->nroutes * sizeof(char *));
+    for(i = 0; i < r->nroutes; i++)
+        routes_built.service[i] = strdup(r->service[i]);
+    routes_built.nroutes = r->nroutes;
+    copy_routes(&routes_built, r);
+}
+
+/*
+ * private: build a perfect hash over the route services (hash and
+ * displace): keys are split into buckets, and every bucket, biggest
+ * first, gets the first displacement that puts all of its keys into
+ * free slots.  A bucket that gets none keeps displacement 0 and its
+ * services are looked up one by one.
+ */
+static void
+build_routes(routes_t *r) {
+
+    int *order, *sizes, *bucket, *placed;
+    int i, j, k, n = r->nroutes, nb;
+    unsigned int d;
+
+    if(n == 0)
+        return;
+
+    pthread_mutex_lock(&routes_lock);
+    if(same_routes(r, &routes_built)) {
+        copy_routes(r, &routes_built);
+        pthread_mutex_unlock(&routes_lock);
+        return;
+    }
+
+    r->nslots = n + n / 4 + 1;
+    r->nbuckets = nb = n / 2 + 1;
+    r->slots = malloc(r->nslots * sizeof(int));
+    r->disp = calloc(nb, sizeof(unsigned int));
+    for(i = 0; i < r->nslots; i++)
+        r->slots[i] = -1;
+
+    bucket = malloc(n * sizeof(int));
+    placed = malloc(n * sizeof(int));
+    sizes = calloc(nb, sizeof(int));
+    order = malloc(nb * sizeof(int));
+    for(i = 0; i < n; i++) {
+        bucket[i] = route_hash(r->service[i], 0) % nb;
+        sizes[bucket[i]]++;
+    }
+
+    /* bucket numbers by decreasing size, there are only a handful */
+    for(i = 0; i < nb; i++) {
+        for(j = i; j > 0 && sizes[order[j - 1]] < sizes[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for(i = 0; i < nb; i++) {
+        for(d = 1; d < (1u << 20); d++) {
+            int np = 0, ok = 1;
+
+            for(k = 0; k < n && ok; k++) {
+                int slot;
+
+                if(bucket[k] != order[i])
+                    continue;
+                slot = route_hash(r->service[k], d) % r->nslots;
+                if(r->slots[slot] != -1)
+                    ok = 0;
+                for(j = 0; j < np && ok; j++)
+                    if(placed[j] == slot)
+                        ok = 0;
+                placed[np++] = slot;
+            }
+            if(!ok)
+                continue;
+
+            r->disp[order[i]] = d;
+            for(k = 0, np = 0; k < n; k++)
+                if(bucket[k] == order[i])
+                    r->slots[placed[np++]] = k;
+            break;
+        }
+        if(r->disp[order[i]] == 0)
+            for(k = 0; k < n; k++)
+                if(bucket[k] == order[i])
+                    SYSLOG("no hash slot for route %s, it is looked up linearly", r->service[k]);
+    }
+
+    keep_routes(r);
+    pthread_mutex_unlock(&routes_lock);
+
+    free(order);
+    free(sizes);
+    free(bucket);
+    free(placed);
+}
+
+/* private: route index for the service, -1 if none */
+static int
+find_route(const routes_t *r, const char *service) {
+
+    int idx;
+    unsigned int d;
+
+    if(r->nroutes == 0 || service == NULL)
+        return -1;
+
+    if((d = r->disp[route_hash(service, 0) % r->nbuckets]) == 0) {
+        /* a bucket build_routes() couldn't place */
+        for(idx = 0; idx < r->nroutes; idx++)
+            if(!strcmp(r->service[idx], service))
+                return idx;
+        return -1;
+    }
+
+    idx = r->slots[route_hash(service, d) % r->nslots];
+    if(idx >= 0 && !strcmp(r->service[idx], service))
+        return idx;
+    return -1;
+}
+
+/* private: replace a list option with a copy of another one, if that is set */
+static void
+override_list(char ***dst, int *ndst, char **src, int nsrc) {
+
+    int i;
+
+    if(nsrc == 0)
+        return;
+    for(i = 0; i < *ndst; i++)
+        free((*dst)[i]);
+    free(*dst);
+    *dst = malloc(nsrc * sizeof(char *));
+    for(i = 0; i < nsrc; i++)
+        (*dst)[i] = strdup(src[i]);
+    *ndst = nsrc;
+}
+
+/* private: is word one of the comma or space separated words in list? */
+static int
+list_has(const char *list, const char *word) {
+
+    size_t len = strlen(word);
+    const char *p = list;
+
+    while(p != NULL && *p) {
+        p += strspn(p, ", \t");
+        if(!strncmp(p, word, len) && (p[len] == '\0' || p[len] == ',' || isspace(p[len])))
+            return 1;
+        p += strcspn(p, ", \t");
+    }
+    return 0;
+}
+
+/* private: is the user a member (primary or supplementary) of a group in list? */
+static int
+user_in_groups(const char *user, const char *list) {
+
+    struct passwd pw, *pwp;
+    struct group gr, *grp;
+    char buf[4096], name[256];
+    gid_t groups[256];
+    int ngroups = 256, i;
+    const char *p = list;
+    size_t len;
+
+    if(getpwnam_r(user, &pw, buf, sizeof(buf), &pwp) != 0 || pwp == NULL)
+        return 0;
+    if(getgrouplist(user, pw.pw_gid, groups, &ngroups) < 0)
+        ngroups = 256;
+
+    while(*p) {
+        p += strspn(p, ", \t");
+        len = strcspn(p, ", \t");
+        if(len > 0 && len < sizeof(name)) {
+            memcpy(name, p, len);
+            name[len] = '\0';
+            if(getgrnam_r(name, &gr, buf, sizeof(buf), &grp) == 0 && grp != NULL)
+                for(i = 0; i < ngroups; i++)
+                    if(groups[i] == gr.gr_gid)
+                        return 1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+/*
+ * Switch the options to the backend routed for this PAM service, if any.
+ * Settings given in the [backend] section replace the global ones.
+ */
+void
+mod_options_service(modopt_t *options, const char *service) {
+
+    modopt_t *b;
+    int idx;
+
+    if(service != NULL && list_has(options->priority_services, service))
+        options->priority = 1;
+
+    if((idx = find_route(&options->routes, service)) < 0)
+        return;
+
+    for(b = options->backends; b != NULL; b = b->next)
+        if(!strcmp(b->backend_name, options->routes.backend[idx]))
+            break;
+
+    if(b == NULL) {
+        SYSLOG("service %s routed to unknown backend %s", service, options->routes.backend[idx]);
+        return;
+    }
+
+    DBGLOG("service %s uses backend %s", service, b->backend_name);
+
+    /* separate connection settings invalidate the global connect string */
+    if(b->connstr == NULL && (b->db || b->host || b->port || b->user || b->passwd || b->timeout || b->sslmode)) {
+        free(options->connstr);
+        options->connstr = NULL;
+    }
+    override_str(&options->connstr, b->connstr);
+    override_str(&options->db, b->db);
+    override_str(&options->host, b->host);
+    override_str(&options->port, b->port);
+    override_str(&options->user, b->user);
+    override_str(&options->passwd, b->passwd);
+    override_str(&options->sslmode, b->sslmode);
+    override_str(&options->timeout, b->timeout);
+    override_str(&options->role, b->role);
+    override_str(&options->query_auth, b->query_auth);
+    override_str(&options->query_auth_succ, b->query_auth_succ);
+    override_str(&options->query_auth_fail, b->query_auth_fail);
+    override_str(&options->query_auth_succ_batch, b->query_auth_succ_batch);
+    override_str(&options->query_auth_fail_batch, b->query_auth_fail_batch);
+    override_str(&options->query_acct, b->query_acct);
+    override_str(&options->query_pwd, b->query_pwd);
+    override_str(&options->query_session_open, b->query_session_open);
+    override_str(&options->query_session_close, b->query_session_close);
+    override_str(&options->history_query, b->history_query);
+    override_str(&options->history_update_query, b->history_update_query);
+    override_str(&options->user_filter, b->user_filter);
+    override_str(&options->breach_file, b->breach_file);
+    override_str(&options->network_file, b->network_file);
+    override_str(&options->allow_from, b->allow_from);
+    override_str(&options->deny_from, b->deny_from);
+    if(b->nshards) {
+        override_list(&options->shards, &options->nshards, b->shards, b->nshards);
+        options->shard_previous = b->shard_previous;
+    }
+    override_list(&options->replicas, &options->nreplicas, b->replicas, b->nreplicas);
+    if(b->replica_max_lag)
+        options->replica_max_lag = b->replica_max_lag;
+    if(b->replica_ryw_window)
+        options->replica_ryw_window = b->replica_ryw_window;
+    if(b->hedge_percentile)
+        options->hedge_percentile = b->hedge_percentile;
+    if(b->hedge_max_rate)
+        options->hedge_max_rate = b->hedge_max_rate;
+    if(b->pw_type)
+        options->pw_type = b->pw_type;
+    if(b->target_hash_ms)
+        options->target_hash_ms = b->target_hash_ms;
+    if(b->pool_size)
+        options->pool_size = b->pool_size;
+    if(b->max_sessions)
+        options->max_sessions = b->max_sessions;
+    if(b->pool_reserved)
+        options->pool_reserved = b->pool_reserved;
+    if(b->admission_timeout)
+        options->admission_timeout = b->admission_timeout;
+    if(b->pool_idle_timeout)
+        options->pool_idle_timeout = b->pool_idle_timeout;
+    if(b->coalesce_queries)
+        options->coalesce_queries = b->coalesce_queries;
+    if(b->wrong_password_ttl)
+        options->wrong_password_ttl = b->wrong_password_ttl;
+}
+
+/* private: jump consistent hash (Lamping, Veach), key -> [0, n) */
+static int
+jump_hash(unsigned long long key, int n) {
+
+    long long b = -1, j = 0;
+
+    while(j < n) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+    }
+    return (int) b;
+}
+
+/* shard of a user among the first n shards */
+int
+mod_options_shard(const char *user, int n) {
+
+    unsigned long long h = 14695981039346656037ULL;
+
+    while(*user) {
+        h ^= (unsigned char) *user++;
+        h *= 1099511628211ULL;
+    }
+    return jump_hash(h, n);
+}
+
+/* Point the options to the shard holding the user, if sharding is configured. */
+void
+mod_options_user(modopt_t *options, const char *user) {
+
+    if(user == NULL || options->nshards == 0)
+        return;
+
+    options->shard = mod_options_shard(user, options->nshards);
+    free(options->connstr);
+    options->connstr = strdup(options->shards[options->shard]);
+    DBGLOG("user %s is on shard %d", user, options->shard);
+}
+
+/* private: is the user in priority_users or priority_groups? */
+static int
+priority_user(modopt_t *options, const char *user) {
+
+    return user != NULL && (list_has(options->priority_users, user) ||
+        (options->priority_groups && user_in_groups(user, options->priority_groups)));
+}
+
+/*
+ * Note whether the user is one of the priority ones.  Only for a user
+ * that is known to be who they claim: anybody can ask to log in as
+ * root, and must not get the connections kept for root by doing so.
+ */
+void
+mod_options_priority(modopt_t *options, const char *user) {
+
+    if(priority_user(options, user))
+        options->priority = 1;
+}
+
+/*
+ * The same while authenticating, where the user is only claimed: such
+ * callers get a capped share of the reserved connections (see
+ * pool_admit()), so that a storm of logins as root can't take them all.
+ */
+void
+mod_options_priority_claim(modopt_t *options, const char *user) {
+
+    if(priority_user(options, user))
+        options->priority_claimed = 1;
+}
+
 static void
 read_config_file(modopt_t *options) {
 
     FILE *fp;
     char buffer[1024];
     char *eq,*val,*end;
+    modopt_t *target = options;
 
     fp = fopen(options->fileconf, "r");
     if (errno == EACCES) {
@@ -53,77 +706,33 @@ read_config_file(modopt_t *options) {
             }
         } else val = NULL;
 
-        if(!strcmp(buffer, "auth_query")) {
-            options->query_auth = strdup(val);
-        } else if( strcmp(buffer, "connect") == 0 ) {
-            options->connstr = strdup(val);
-        } else if(!strcmp(buffer, "auth_succ_query")) {
-            options->query_auth_succ = strdup(val);
-        } else if(!strcmp(buffer, "auth_fail_query")) {
-            options->query_auth_fail = strdup(val);
-        } else if(!strcmp(buffer, "acct_query")) {
-            options->query_acct = strdup(val);
-        } else if(!strcmp(buffer, "pwd_query")) {
-            options->query_pwd = strdup(val);
-        } else if(!strcmp(buffer, "session_open_query")) {
-            options->query_session_open = strdup(val);
-        } else if(!strcmp(buffer, "session_close_query")) {
-            options->query_session_close = strdup(val);
-        } else if(!strcmp(buffer, "database")) {
-            options->db = strdup(val);
-        } else if(!strcmp(buffer, "table")) {
-            options->table = strdup(val);
-        } else if(!strcmp(buffer, "host")) {
-            options->host = strdup(val);
-        } else if(!strcmp(buffer, "port")) {
-            options->port = strdup(val);
-        } else if(!strcmp(buffer, "timeout")) {
-            options->timeout = strdup(val);
-        } else if(!strcmp(buffer, "user")) {
-            options->user = strdup(val);
-        } else if(!strcmp(buffer, "sslmode")) {
-
-            /* If not a valid option */
-            if(strcmp(val, "require") != 0 && strcmp(val, "prefer") != 0 && strcmp(val, "allow") != 0 && strcmp(val,"disable") != 0) {
-                SYSLOG("sslmode \"%s\" is not a valid option! Falling back to \"prefer\".", val);
-                options->sslmode = strdup("prefer");
-            } else
-                options->sslmode = strdup(val);
-        } else if(!strcmp(buffer, "password")) {
-            options->passwd = strdup(val);
-        } else if(!strcmp(buffer, "user_column")) {
-            options->column_user = strdup(val);
-        } else if(!strcmp(buffer, "pwd_column")) {
-            options->column_pwd = strdup(val);
-        } else if(!strcmp(buffer, "expired_column")) {
-            options->column_expired = strdup(val);
-        } else if(!strcmp(buffer, "newtok_column")) {
-            options->column_newpwd = strdup(val);
-        } else if(!strcmp(buffer, "pw_type")) {
-            options->pw_type = PW_CLEAR;
-            if(!strcmp(val, "md5")) {
-                options->pw_type = PW_MD5;
-            } else if(!strcmp(val, "sha1")) {
-                options->pw_type = PW_SHA1;
-            } else if(!strcmp(val, "crypt")) {
-                options->pw_type = PW_CRYPT;
-            } else if(!strcmp(val, "crypt_md5")) {
-                options->pw_type = PW_CRYPT_MD5;
-            } else if(!strcmp(val, "crypt_sha512")) {
-                options->pw_type = PW_CRYPT_SHA512;
-            } else if(!strcmp(val, "md5_postgres")) {
-                options->pw_type = PW_MD5_POSTGRES;
-            } else if(!strcmp(val, "function")) {
-                options->pw_type = PW_FUNCTION;
+        if(buffer[0] == '[') {
+
+            /* [backend name] starts a section, everything up to the next one belongs to it */
+            if(strncmp(buffer, "[backend ", 9) == 0 && (end = strchr(buffer, ']')) != NULL) {
+                *end = '\0';
+                target = (modopt_t *) calloc(1, sizeof(modopt_t));
+                target->backend_name = strdup(buffer + 9);
+                target->next = options->backends;
+                options->backends = target;
+            } else {
+                SYSLOG("unknown config file section %s", buffer);
             }
-        } else if(!strcmp(buffer, "debug")) {
-            options->debug = 1;
+
+        } else if(val != NULL && !strcmp(buffer, "route")) {
+            add_route(options, val);
+        } else if(target != options && val != NULL && !backend_key(buffer)) {
+            SYSLOG("%s can't be set in backend section %s, ignored", buffer, target->backend_name);
+        } else {
+            set_option(target, buffer, val);
         }
 
     }
 
     fclose(fp);
 
+    build_routes(&options->routes);
+
     return;
 }
 
@@ -159,6 +768,7 @@ modopt_t * mod_options(int argc, const char **argv) {
     modopt->passwd = NULL;
     modopt->pw_type = PW_SHA1;
     modopt->sslmode = strdup("prefer");
+    modopt->role = NULL;
     modopt->timeout = NULL;
     modopt->fileconf = NULL;
     modopt->column_pwd = NULL;
@@ -170,11 +780,61 @@ modopt_t * mod_options(int argc, const char **argv) {
     modopt->query_auth = NULL;
     modopt->query_auth_succ = NULL;
     modopt->query_auth_fail = NULL;
+    modopt->query_auth_succ_batch = NULL;
+    modopt->query_auth_fail_batch = NULL;
     modopt->query_session_open = NULL;
     modopt->query_session_close = NULL;
+    modopt->session_sync_query = NULL;
+    modopt->history_query = NULL;
+    modopt->history_update_query = NULL;
+    modopt->history_threads = 4;
+    modopt->breach_file = NULL;
+    modopt->user_filter = NULL;
+    modopt->target_hash_ms = 0;
+    modopt->wrong_password_ttl = 0;
     modopt->port = strdup("5432");
+    modopt->network_file = NULL;
+    modopt->allow_from = NULL;
+    modopt->deny_from = NULL;
+    modopt->pool_size = 0;
+    modopt->pool_idle_timeout = 300;
+    modopt->pool_reserved = 0;
+    modopt->admission_timeout = 0;
+    modopt->priority_users = NULL;
+    modopt->priority_groups = NULL;
+    modopt->priority_services = NULL;
+    modopt->priority = 0;
+    modopt->priority_claimed = 0;
+    modopt->coalesce_queries = 0;
+    modopt->write_behind_interval = 10;
+    modopt->max_sessions = 0;
+    modopt->session_sync_interval = 60;
+    modopt->heavy_hitters = 0;
+    modopt->heavy_hitters_window = 300;
+    modopt->trace_file = NULL;
+    modopt->trace_sample = 100;
+    modopt->trace_file_size = 10 * 1024 * 1024;
+    modopt->flight_recorder = 0;
+    modopt->phase_stats = 0;
+    modopt->trace = NULL;
+    modopt->dns_cache_ttl = 60;
+    modopt->dns_negative_ttl = 10;
     modopt->debug = 0;
     modopt->std_flags = 0;
+    modopt->shards = NULL;
+    modopt->nshards = 0;
+    modopt->shard = 0;
+    modopt->shard_previous = 0;
+    modopt->replicas = NULL;
+    modopt->nreplicas = 0;
+    modopt->replica_max_lag = 5;
+    modopt->replica_ryw_window = 300;
+    modopt->hedge_percentile = 0;
+    modopt->hedge_max_rate = 10;
+    modopt->backend_name = NULL;
+    modopt->backends = NULL;
+    modopt->next = NULL;
+    memset(&modopt->routes, 0, sizeof(modopt->routes));
 
     for(i=0; i<argc; i++) {
 
@@ -193,36 +853,39 @@ modopt_t * mod_options(int argc, const char **argv) {
             value = strndup(ptr+1, strchr(argv[i],'\0')-ptr);
 
             if( strcmp(option, "host") == 0 ) {
-                modopt->host = strdup(value);
+                override_str(&modopt->host, value);
             } else if( strcmp(option, "config_file") == 0 ) {
-                modopt->fileconf = strdup(value);
+                override_str(&modopt->fileconf, value);
             } else if( strcmp(option, "database") == 0 ) {
-                modopt->db = strdup(value);
+                override_str(&modopt->db, value);
             } else if( strcmp(option, "table") == 0 ) {
-                modopt->table = strdup(value);
+                override_str(&modopt->table, value);
             } else if( strcmp(option, "user") == 0 ) {
-                modopt->user = strdup(value);
+                override_str(&modopt->user, value);
             } else if( strcmp(option, "password") == 0 ) {
-                modopt->passwd = strdup(value);
+                override_str(&modopt->passwd, value);
             } else if( strcmp(option, "sslmode") == 0 ) {
 
                 /* If not a valid option */
                 if(strcmp(value, "require") != 0 && strcmp(value, "prefer") != 0 && strcmp(value, "allow") != 0 && strcmp(value,"disable") != 0) {
                     SYSLOG("sslmode \"%s\" is not a valid option! Falling back to \"prefer\".", value);
-                    modopt->sslmode = strdup("prefer");
+                    override_str(&modopt->sslmode, "prefer");
                 } else
-                    modopt->sslmode = strdup(value);
+                    override_str(&modopt->sslmode, value);
 
             } else if( strcmp(option, "debug") == 0 ) {
                 modopt->debug = atoi(value);
             } else if( strcmp(option, "port") == 0 ) {
-                modopt->port = strdup(value);
+                override_str(&modopt->port, value);
             }
 
+            free(option);
+            free(value);
+
         } else {
 
             if( strcmp(argv[i], "fileconf") == 0 ) {
-                modopt->fileconf = strdup(PAM_PGSQL_FILECONF);
+                override_str(&modopt->fileconf, PAM_PGSQL_FILECONF);
             } else if( strcmp(argv[i], "force") == 0 ) {
                 force = 1;
             }
@@ -299,12 +962,79 @@ modopt_t * mod_options(int argc, const char **argv) {
 }
 
 
-static void free_mod_options(modopt_t *options) {
+/* private: free a list option */
+static void
+free_list(char **list, int n) {
+
+    int i;
+
+    for(i = 0; i < n; i++)
+        free(list[i]);
+    free(list);
+}
+
+/*
+ * Free the options returned by mod_options(), with the [backend] sections
+ * and routes.  The trace of the call must have been ended with
+ * trace_finish() already.
+ */
+void
+free_mod_options(modopt_t *options) {
+
+    modopt_t *b;
 
     if(options == NULL)
         return;
 
+    while((b = options->backends) != NULL) {
+        options->backends = b->next;
+        free_mod_options(b);
+    }
 
-    return;
+    free(options->connstr);
+    free(options->fileconf);
+    free(options->host);
+    free(options->db);
+    free(options->table);
+    free(options->timeout);
+    free(options->user);
+    free(options->passwd);
+    free(options->sslmode);
+    free(options->role);
+    free(options->column_pwd);
+    free(options->column_user);
+    free(options->column_expired);
+    free(options->column_newpwd);
+    free(options->query_acct);
+    free(options->query_pwd);
+    free(options->query_auth);
+    free(options->query_auth_succ);
+    free(options->query_auth_fail);
+    free(options->query_auth_succ_batch);
+    free(options->query_auth_fail_batch);
+    free(options->query_session_open);
+    free(options->query_session_close);
+    free(options->session_sync_query);
+    free(options->history_query);
+    free(options->history_update_query);
+    free(options->breach_file);
+    free(options->user_filter);
+    free(options->port);
+    free(options->network_file);
+    free(options->allow_from);
+    free(options->deny_from);
+    free(options->trace_file);
+    free(options->priority_users);
+    free(options->priority_groups);
+    free(options->priority_services);
+    free(options->backend_name);
+    free_list(options->shards, options->nshards);
+    free_list(options->replicas, options->nreplicas);
+
+    free_list(options->routes.service, options->routes.nroutes);
+    free_list(options->routes.backend, options->routes.nroutes);
+    free(options->routes.slots);
+    free(options->routes.disp);
 
+    free(options);
 }
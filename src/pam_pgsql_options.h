@@ -30,6 +30,17 @@ typedef enum {
     PW_FUNCTION
 } pw_scheme;
 
+/* service -> backend routes, looked up through a perfect hash */
+typedef struct routes_s {
+	char **service;
+	char **backend;
+	int nroutes;
+	int *slots;
+	int nslots;
+	unsigned int *disp;
+	int nbuckets;
+} routes_t;
+
 typedef struct modopt_s {
 
    char *connstr;
@@ -41,6 +52,7 @@ typedef struct modopt_s {
    char *user;
    char *passwd;
    char *sslmode;
+	char *role;
 	char *column_pwd;
 	char *column_user;
 	char *column_expired;
@@ -50,16 +62,80 @@ typedef struct modopt_s {
 	char *query_auth;
 	char *query_auth_succ;
 	char *query_auth_fail;
+	char *query_auth_succ_batch;
+	char *query_auth_fail_batch;
 	char *query_session_open;
 	char *query_session_close;
+	char *session_sync_query;
+	char *history_query;
+	char *history_update_query;
+	char *breach_file;
+	char *user_filter;
    char *port;
+	char *network_file;
+	char *allow_from;
+	char *deny_from;
+	char *trace_file;
+	char *priority_users;
+	char *priority_groups;
+	char *priority_services;
 	int pw_type;
+	int pool_size;
+	int pool_idle_timeout;
+	int pool_reserved;
+	int admission_timeout;
+	int coalesce_queries;
+	int write_behind_interval;
+	int max_sessions;
+	int session_sync_interval;
+	int history_threads;
+	int target_hash_ms;
+	int wrong_password_ttl;
+	int heavy_hitters;
+	int heavy_hitters_window;
+	int trace_sample;
+	long trace_file_size;
+	int flight_recorder;
+	int phase_stats;
+	int dns_cache_ttl;
+	int dns_negative_ttl;
    int debug;
 	int std_flags;
+	int priority;		/* caller may use the reserved pool slots */
+	int priority_claimed;	/* claims to be a priority user, not authenticated yet */
+
+	/* shard connect strings, users are spread over them by jump hash */
+	char **shards;
+	int nshards;
+	int shard;
+	int shard_previous;
+
+	/* read replicas of the primary */
+	char **replicas;
+	int nreplicas;
+	int replica_max_lag;
+	int replica_ryw_window;
+	int hedge_percentile;
+	int hedge_max_rate;
+
+	/* [backend name] sections and the routes to them */
+	char *backend_name;
+	struct modopt_s *backends;
+	struct modopt_s *next;
+	routes_t routes;
+
+	/* trace of the current call, NULL when it isn't sampled */
+	struct trace_s *trace;
 
 } modopt_t;
 
 modopt_t * mod_options(int , const char **);
+void free_mod_options(modopt_t *);
+void mod_options_service(modopt_t *, const char *);
+void mod_options_user(modopt_t *, const char *);
+void mod_options_priority(modopt_t *, const char *);
+void mod_options_priority_claim(modopt_t *, const char *);
+int mod_options_shard(const char *, int);
 
 
 int  pam_get_pass(pam_handle_t *, int, const char **, const char *, int);
@@ -0,0 +1,61 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Prints what the module collects in shared memory.  Run it as the
+ * user the PAM stacks run as (normally root), the tables are private
+ * to that user.
+ *
+ *	pam_pgsql_stat top [-n count]		heavy hitters, see topk.c
+ *	pam_pgsql_stat recent [-n count]	flight recorder, see flight.c
+ *	pam_pgsql_stat phases			time per phase, see phase_stats.c
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "flight.h"
+#include "phase_stats.h"
+#include "topk.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: pam_pgsql_stat top|recent|phases [-n count]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *command;
+	int opt, limit = 20;
+
+	if (argc < 2)
+		usage();
+	command = argv[1];
+	argc--;
+	argv++;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n': limit = atoi(optarg); break;
+			default: usage();
+		}
+	}
+
+	if (!strcmp(command, "top"))
+		return topk_dump(stdout, limit) == 0 ? 0 : 1;
+	if (!strcmp(command, "recent"))
+		return flight_dump(stdout, limit) == 0 ? 0 : 1;
+	if (!strcmp(command, "phases"))
+		return phase_stats_dump(stdout) == 0 ? 0 : 1;
+
+	usage();
+	return 1;
+}
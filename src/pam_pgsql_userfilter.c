@@ -0,0 +1,245 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Builds the user filter used by user_filter, see userfilter.c, from the
+ * user names returned by a query or read from stdin (one per line), or
+ * adds names to an existing one in place.  A new filter is sized for
+ * the names plus a quarter for accounts added later (or -n names) at the
+ * false positive rate given with -e (default 0.01), written next to the
+ * filter and renamed over it.  Both hold an exclusive flock() on
+ * "filter.lock" from before the names are read until the filter is
+ * written, so that a name added in place is neither lost to another -a
+ * nor written into a filter that a rebuild is about to replace.
+ *
+ *	pam_pgsql_userfilter [-e rate] [-n names] [-c connect -q query] filter
+ *	pam_pgsql_userfilter -a filter name ...
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <libpq-fe.h>
+
+#include <security/pam_appl.h>
+
+#include "userfilter.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: pam_pgsql_userfilter [-e rate] [-n names] [-c connect -q query] filter\n"
+	    "       pam_pgsql_userfilter -a filter name ...\n");
+	exit(1);
+}
+
+static unsigned long long
+be64(const unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static void
+put_be64(unsigned char *p, unsigned long long v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+/* private: take the lock of the filter at path, -1 on failure */
+static int
+lock_filter(const char *path)
+{
+	char *lock;
+	int fd;
+
+	lock = malloc(strlen(path) + 6);
+	sprintf(lock, "%s.lock", path);
+	if ((fd = open(lock, O_RDWR | O_CREAT, 0600)) < 0 || flock(fd, LOCK_EX) != 0) {
+		perror(lock);
+		fd = -1;
+	}
+	free(lock);
+	return fd;
+}
+
+/* private: add names to an existing filter, readers see them right away */
+static int
+add_names(const char *path, char **names, int n)
+{
+	struct stat st;
+	unsigned char *map;
+	unsigned long long nblocks, k;
+	int fd, i;
+
+	if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		return 1;
+	}
+	map = st.st_size >= USERFILTER_HEADER ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED || memcmp(map, USERFILTER_MAGIC, 8) != 0 ||
+	    (nblocks = be64(map + 8)) == 0 || (k = be64(map + 16)) == 0 ||
+	    USERFILTER_HEADER + nblocks * USERFILTER_BLOCK != (unsigned long long) st.st_size) {
+		fprintf(stderr, "%s is not a user filter\n", path);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++)
+		userfilter_add(map + USERFILTER_HEADER, nblocks, k, names[i]);
+	put_be64(map + 24, be64(map + 24) + n);
+	if (msync(map, st.st_size, MS_SYNC) != 0) {
+		perror(path);
+		return 1;
+	}
+	munmap(map, st.st_size);
+	printf("%d names added to %s\n", n, path);
+	return 0;
+}
+
+/* private: write a new filter for names */
+static int
+build(const char *path, char **names, int n, unsigned long long capacity, double rate)
+{
+	unsigned long long nblocks;
+	unsigned char *map;
+	double bits;
+	off_t size;
+	char *tmp;
+	int fd, i, k;
+
+	/* bits per name and bits set per name of the best plain Bloom filter */
+	bits = -log(rate) / (M_LN2 * M_LN2);
+	k = (int) (bits * M_LN2 + 0.5);
+	if (k < 1)
+		k = 1;
+	if (k > 16)
+		k = 16;
+	nblocks = (unsigned long long) (capacity * bits / (USERFILTER_BLOCK * 8)) + 1;
+	size = USERFILTER_HEADER + nblocks * USERFILTER_BLOCK;
+
+	tmp = malloc(strlen(path) + 8);
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0 || fchmod(fd, 0644) != 0 || ftruncate(fd, size) != 0) {
+		perror(tmp);
+		if (fd >= 0)
+			unlink(tmp);
+		return 1;
+	}
+	if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("pam_pgsql_userfilter: mmap");
+		unlink(tmp);
+		return 1;
+	}
+
+	memcpy(map, USERFILTER_MAGIC, 8);
+	put_be64(map + 8, nblocks);
+	put_be64(map + 16, k);
+	put_be64(map + 24, n);
+	for (i = 0; i < n; i++)
+		userfilter_add(map + USERFILTER_HEADER, nblocks, k, names[i]);
+
+	if (msync(map, size, MS_SYNC) != 0 || fsync(fd) != 0) {
+		perror(tmp);
+		unlink(tmp);
+		return 1;
+	}
+	munmap(map, size);
+	close(fd);
+	if (rename(tmp, path) != 0) {
+		perror(path);
+		unlink(tmp);
+		return 1;
+	}
+	printf("%d names written to %s, %llu kB, room for %llu\n", n, path,
+	    (unsigned long long) size / 1024, capacity);
+	free(tmp);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *connstr = NULL, *query = NULL;
+	char **names = NULL, line[1024];
+	unsigned long long capacity = 0;
+	double rate = 0.01;
+	PGconn *conn = NULL;
+	PGresult *res = NULL;
+	int opt, add = 0, n = 0, i, rc, lock;
+	size_t len;
+
+	while ((opt = getopt(argc, argv, "ac:e:n:q:")) != -1) {
+		switch (opt) {
+			case 'a': add = 1; break;
+			case 'c': connstr = optarg; break;
+			case 'e': rate = atof(optarg); break;
+			case 'n': capacity = strtoull(optarg, NULL, 10); break;
+			case 'q': query = optarg; break;
+			default: usage();
+		}
+	}
+	if (optind >= argc || (connstr == NULL) != (query == NULL) || rate <= 0 || rate >= 1)
+		usage();
+
+	if (!add && optind + 1 != argc)
+		usage();
+
+	/* held until we exit */
+	if ((lock = lock_filter(argv[optind])) < 0)
+		return 1;
+	if (add)
+		return add_names(argv[optind], argv + optind + 1, argc - optind - 1);
+
+	if (connstr != NULL) {
+		conn = PQconnectdb(connstr);
+		if (PQstatus(conn) != CONNECTION_OK) {
+			fprintf(stderr, "%s", PQerrorMessage(conn));
+			return 1;
+		}
+		res = PQexec(conn, query);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+			fprintf(stderr, "%s", PQresultErrorMessage(res));
+			return 1;
+		}
+		names = malloc((PQntuples(res) + 1) * sizeof(char *));
+		for (i = 0; i < PQntuples(res); i++)
+			if (!PQgetisnull(res, i, 0))
+				names[n++] = PQgetvalue(res, i, 0);
+	} else {
+		while (fgets(line, sizeof(line), stdin) != NULL) {
+			len = strlen(line);
+			while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+				line[--len] = '\0';
+			if (len == 0)
+				continue;
+			if ((n & (n - 1)) == 0)
+				names = realloc(names, (n ? 2 * n : 1) * sizeof(char *));
+			names[n++] = strdup(line);
+		}
+	}
+
+	if (capacity < n + n / 4 + 1)
+		capacity = n + n / 4 + 1;
+	rc = build(argv[optind], names, n, capacity, rate);
+
+	PQclear(res);
+	if (conn != NULL)
+		PQfinish(conn);
+	return rc;
+}
@@ -0,0 +1,75 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * With phase_stats = 1, the wall and thread CPU time of every phase of
+ * every PAM call (the spans of trace.c: options, dns, connect, each
+ * query, verify, and the calls themselves) are added up in shared
+ * memory.  The difference is time spent off the CPU: waiting for the
+ * network, the database or a lock.  "pam_pgsql_stat phases" prints the
+ * totals, so a host busy hashing passwords looks different from one
+ * waiting for its database.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "flight.h"
+#include "phase_stats.h"
+#include "shm.h"
+
+#define PHASE_STATS_SHM  "/pam_pgsql_phases"
+
+struct phase_total {
+	unsigned long long count;
+	unsigned long long wall_us;
+	unsigned long long cpu_us;
+};
+
+static struct phase_total *totals = NULL;
+
+static struct phase_total *
+phase_totals(void)
+{
+	if (totals == NULL)
+		totals = shm_attach(PHASE_STATS_SHM, FLIGHT_NAMES * sizeof(struct phase_total));
+	return totals;
+}
+
+void
+phase_stats_add(int name, unsigned long long wall_us, unsigned long long cpu_us)
+{
+	struct phase_total *t;
+
+	if (name <= 0 || name >= FLIGHT_NAMES || (t = phase_totals()) == NULL)
+		return;
+	/* CPU time can't be more than wall time, except for clock granularity */
+	if (cpu_us > wall_us)
+		cpu_us = wall_us;
+	__atomic_fetch_add(&t[name].count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t[name].wall_us, wall_us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t[name].cpu_us, cpu_us, __ATOMIC_RELAXED);
+}
+
+int
+phase_stats_dump(FILE *fp)
+{
+	struct phase_total *t, c;
+	int i;
+
+	if ((t = phase_totals()) == NULL)
+		return -1;
+
+	fprintf(fp, "%-22s %10s %14s %14s %14s %6s\n", "phase", "count", "wall ms", "cpu ms", "off-cpu ms", "cpu %");
+	for (i = 1; i < FLIGHT_NAMES; i++) {
+		c.count = __atomic_load_n(&t[i].count, __ATOMIC_RELAXED);
+		c.wall_us = __atomic_load_n(&t[i].wall_us, __ATOMIC_RELAXED);
+		c.cpu_us = __atomic_load_n(&t[i].cpu_us, __ATOMIC_RELAXED);
+		if (c.count == 0)
+			continue;
+		fprintf(fp, "%-22s %10llu %14.1f %14.1f %14.1f %6.1f\n", flight_str(i), c.count,
+		    c.wall_us / 1000.0, c.cpu_us / 1000.0, (c.wall_us - c.cpu_us) / 1000.0,
+		    c.wall_us ? 100.0 * c.cpu_us / c.wall_us : 0.0);
+	}
+	return 0;
+}
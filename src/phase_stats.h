@@ -0,0 +1,9 @@
+#ifndef __PAM_PGSQL_PHASE_STATS_H
+#define __PAM_PGSQL_PHASE_STATS_H
+
+#include <stdio.h>
+
+void phase_stats_add(int name, unsigned long long wall_us, unsigned long long cpu_us);
+int phase_stats_dump(FILE *fp);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Read replicas.  auth_query and acct_query may be sent to one of the
+ * configured replicas, unless
+ *  - the user changed the password less than replica_ryw_window seconds
+ *    ago (recorded in shared memory, the change and the next login are
+ *    usually done by different processes), or
+ *  - the replica replays more than replica_max_lag seconds behind, as
+ *    measured every REPLICA_CHECK_INTERVAL seconds.
+ * in which case the primary answers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+
+#include "pam_pgsql.h"
+#include "replica.h"
+#include "shm.h"
+
+#define REPLICA_CHECK_INTERVAL  5
+#define WRITERS_SHM             "/pam_pgsql_writers"
+#define WRITERS_SETS            1024
+#define WRITERS_WAYS            4
+
+/*
+ * A replica that replayed all it received is only current while it is
+ * streaming: one cut off from the primary has nothing left to replay
+ * either.  Otherwise the age of the last replayed transaction is the lag
+ * (pg_stat_wal_receiver.status reads as NULL without pg_read_all_stats,
+ * so such a role always gets that), and a replica that never replayed
+ * one is not used.
+ */
+#define REPLICA_LAG_QUERY \
+	"select case when not pg_is_in_recovery() then 0 " \
+	"when pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() " \
+	"and exists (select 1 from pg_stat_wal_receiver where status = 'streaming') then 0 " \
+	"else coalesce(extract(epoch from now() - pg_last_xact_replay_timestamp())::float8, " \
+	"'infinity') end"
+
+struct writer {
+	unsigned long long key;
+	time_t when;
+};
+
+struct replica_state {
+	char *connstr;
+	time_t checked;
+	int healthy;
+	struct replica_state *next;
+};
+
+static struct writer *writers = NULL;
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct replica_state *replicas = NULL;
+static unsigned int replica_next = 0;
+
+/* private: 64 bit FNV-1a of the user, never 0 (empty slot) */
+static unsigned long long
+writer_key(const char *user)
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	while (*user) {
+		h ^= (unsigned char) *user++;
+		h *= 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+static struct writer *
+writers_set(unsigned long long key)
+{
+	if (writers == NULL &&
+	    (writers = shm_attach(WRITERS_SHM, WRITERS_SETS * WRITERS_WAYS * sizeof(struct writer))) == NULL)
+		return NULL;
+	return &writers[(key % WRITERS_SETS) * WRITERS_WAYS];
+}
+
+/* remember that the user just wrote to the primary */
+void
+replica_note_write(modopt_t *options, const char *user)
+{
+	struct writer *set, *w;
+	unsigned long long key;
+	int i;
+
+	if (options->nreplicas == 0 || user == NULL || (set = writers_set(key = writer_key(user))) == NULL)
+		return;
+
+	/* reuse the user's entry, else evict the oldest one of the set */
+	for (w = set, i = 0; i < WRITERS_WAYS; i++) {
+		if (__atomic_load_n(&set[i].key, __ATOMIC_RELAXED) == key) {
+			w = &set[i];
+			break;
+		}
+		if (set[i].when < w->when)
+			w = &set[i];
+	}
+	__atomic_store_n(&w->when, time(NULL), __ATOMIC_RELAXED);
+	__atomic_store_n(&w->key, key, __ATOMIC_RELEASE);
+}
+
+/* private: did the user write within the read-your-writes window? */
+static int
+replica_recent_writer(modopt_t *options, const char *user)
+{
+	struct writer *set;
+	unsigned long long key;
+	int i;
+
+	if (user == NULL || (set = writers_set(key = writer_key(user))) == NULL)
+		return 0;
+	for (i = 0; i < WRITERS_WAYS; i++)
+		if (__atomic_load_n(&set[i].key, __ATOMIC_ACQUIRE) == key &&
+		    time(NULL) - __atomic_load_n(&set[i].when, __ATOMIC_RELAXED) < options->replica_ryw_window)
+			return 1;
+	return 0;
+}
+
+/* private: called with replica_lock held */
+static struct replica_state *
+replica_find(const char *connstr)
+{
+	struct replica_state *r;
+
+	for (r = replicas; r != NULL; r = r->next)
+		if (!strcmp(r->connstr, connstr))
+			return r;
+
+	r = calloc(1, sizeof(struct replica_state));
+	r->connstr = strdup(connstr);
+	r->next = replicas;
+	replicas = r;
+	return r;
+}
+
+/* private: measure how far behind the replica replays */
+static int
+replica_check(modopt_t *options, const char *connstr)
+{
+	PGconn *conn;
+	PGresult *res;
+	char *primary;
+	double lag = -1;
+
+	primary = options->connstr;
+	options->connstr = (char *) connstr;
+	if ((conn = db_connect(options)) != NULL) {
+		res = PQexec(conn, REPLICA_LAG_QUERY);
+		if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+			lag = atof(PQgetvalue(res, 0, 0));
+		PQclear(res);
+		db_release(options, conn);
+	}
+	options->connstr = primary;
+
+	if (lag < 0 || lag > options->replica_max_lag) {
+		SYSLOG("replica not used, %s", lag < 0 ? "unreachable" : "lagging behind");
+		return 0;
+	}
+	DBGLOG("replica lag %.3fs", lag);
+	return 1;
+}
+
+/* pick a replica other than exclude for a read by user, NULL means use the primary */
+const char *
+replica_choose(modopt_t *options, const char *user, const char *exclude)
+{
+	struct replica_state *r;
+	const char *connstr;
+	unsigned int start;
+	int i, healthy;
+
+	if (options->nreplicas == 0 || replica_recent_writer(options, user))
+		return NULL;
+
+	pthread_mutex_lock(&replica_lock);
+	start = replica_next++;
+	pthread_mutex_unlock(&replica_lock);
+
+	for (i = 0; i < options->nreplicas; i++) {
+		connstr = options->replicas[(start + i) % options->nreplicas];
+		if (exclude != NULL && !strcmp(connstr, exclude))
+			continue;
+
+		pthread_mutex_lock(&replica_lock);
+		r = replica_find(connstr);
+		if (time(NULL) - r->checked < REPLICA_CHECK_INTERVAL) {
+			healthy = r->healthy;
+			pthread_mutex_unlock(&replica_lock);
+		} else {
+			/* one caller measures, the others go by the old verdict meanwhile */
+			r->checked = time(NULL);
+			pthread_mutex_unlock(&replica_lock);
+			healthy = replica_check(options, connstr);
+			pthread_mutex_lock(&replica_lock);
+			r->healthy = healthy;
+			pthread_mutex_unlock(&replica_lock);
+		}
+		if (healthy)
+			return connstr;
+	}
+	return NULL;
+}
+
+/* a read on the replica failed, don't use it until the next check */
+void
+replica_failed(modopt_t *options, const char *connstr)
+{
+	struct replica_state *r;
+
+	pthread_mutex_lock(&replica_lock);
+	r = replica_find(connstr);
+	r->healthy = 0;
+	r->checked = time(NULL);
+	pthread_mutex_unlock(&replica_lock);
+}
@@ -0,0 +1,10 @@
+#ifndef __PAM_PGSQL_REPLICA_H
+#define __PAM_PGSQL_REPLICA_H
+
+#include "pam_pgsql_options.h"
+
+const char * replica_choose(modopt_t *options, const char *user, const char *exclude);
+void replica_failed(modopt_t *options, const char *connstr);
+void replica_note_write(modopt_t *options, const char *user);
+
+#endif
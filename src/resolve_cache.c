@@ -0,0 +1,186 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * rhost -> address resolution for the %i placeholder.  Numeric literals
+ * never hit the resolver; names are cached, positive and negative, in a
+ * direct-mapped table in shared memory so that the next login from the
+ * same host (usually in another sshd child) skips the DNS round trip.
+ *
+ * Every slot is guarded by a sequence counter: writers move it from even
+ * to odd while they update the slot, readers retry (or just miss) when
+ * they see an odd or changed value.  Writers first claim the slot with
+ * their pid, so a slot left odd by a writer that died half way is taken
+ * over by the next one, as shm_lock() does for dead holders.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "pam_pgsql.h"
+#include "resolve_cache.h"
+#include "shm.h"
+#include "trace.h"
+
+#define DNS_CACHE_SHM      "/pam_pgsql_dns"
+#define DNS_CACHE_SLOTS    1024
+#define DNS_CACHE_HOSTLEN  128
+
+struct dns_slot {
+	pid_t writer;
+	unsigned int seq;
+	int negative;
+	time_t expires;
+	char host[DNS_CACHE_HOSTLEN];
+	char addr[INET6_ADDRSTRLEN];
+};
+
+static struct dns_slot *dns_table = NULL;
+
+/* private: FNV-1a, good enough to spread host names over the slots */
+static unsigned int
+dns_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* private: 1 on hit (*addr is NULL for a negative entry), 0 on miss */
+static int
+dns_cache_get(struct dns_slot *slot, const char *rhost, char **addr)
+{
+	struct dns_slot copy;
+	unsigned int seq;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return 0;
+	memcpy(&copy, slot, sizeof(copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+		return 0;
+
+	copy.host[DNS_CACHE_HOSTLEN - 1] = '\0';
+	copy.addr[INET6_ADDRSTRLEN - 1] = '\0';
+	if (copy.expires < time(NULL) || strcmp(copy.host, rhost) != 0)
+		return 0;
+
+	*addr = copy.negative ? NULL : strdup(copy.addr);
+	return 1;
+}
+
+static void
+dns_cache_put(struct dns_slot *slot, const char *rhost, const char *addr, int ttl)
+{
+	unsigned int seq;
+	pid_t owner = 0;
+
+	/* somebody else is writing this slot right now, let them win,
+	 * unless they died doing it */
+	if (!__atomic_compare_exchange_n(&slot->writer, &owner, getpid(), 0,
+	                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) &&
+	    (kill(owner, 0) == 0 || errno != ESRCH ||
+	     !__atomic_compare_exchange_n(&slot->writer, &owner, getpid(), 0,
+	                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+		return;
+
+	/* a dead writer may have left the counter odd already */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) | 1;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	strncpy(slot->host, rhost, DNS_CACHE_HOSTLEN - 1);
+	slot->host[DNS_CACHE_HOSTLEN - 1] = '\0';
+	if (addr != NULL) {
+		strncpy(slot->addr, addr, INET6_ADDRSTRLEN - 1);
+		slot->addr[INET6_ADDRSTRLEN - 1] = '\0';
+	} else {
+		slot->addr[0] = '\0';
+	}
+	slot->negative = (addr == NULL);
+	slot->expires = time(NULL) + ttl;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->writer, 0, __ATOMIC_RELEASE);
+}
+
+/* private: ask the system resolver, IPv4 only as gethostbyname() did */
+static char *
+dns_lookup(const char *rhost)
+{
+	struct addrinfo hints, *ai;
+	char *addr = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	if (getaddrinfo(rhost, NULL, &hints, &ai) == 0) {
+		addr = malloc(INET_ADDRSTRLEN);
+		inet_ntop(AF_INET, &((struct sockaddr_in *) ai->ai_addr)->sin_addr, addr, INET_ADDRSTRLEN);
+		freeaddrinfo(ai);
+	}
+	return addr;
+}
+
+/* resolve rhost to a malloc'ed address string, NULL if it doesn't resolve */
+char *
+resolve_rhost(modopt_t *options, const char *rhost)
+{
+	unsigned char buf[sizeof(struct in6_addr)];
+	struct dns_slot *slot;
+	char *addr;
+	int span;
+
+	if (rhost == NULL || *rhost == '\0')
+		return NULL;
+
+	/* fast path: already an address, just normalize it */
+	if (inet_pton(AF_INET, rhost, buf) == 1) {
+		addr = malloc(INET_ADDRSTRLEN);
+		inet_ntop(AF_INET, buf, addr, INET_ADDRSTRLEN);
+		return addr;
+	}
+	if (inet_pton(AF_INET6, rhost, buf) == 1) {
+		addr = malloc(INET6_ADDRSTRLEN);
+		inet_ntop(AF_INET6, buf, addr, INET6_ADDRSTRLEN);
+		return addr;
+	}
+
+	span = trace_span(options, "dns");
+	if (options->dns_cache_ttl <= 0 || strlen(rhost) >= DNS_CACHE_HOSTLEN ||
+	    (dns_table == NULL &&
+	     (dns_table = shm_attach(DNS_CACHE_SHM, DNS_CACHE_SLOTS * sizeof(struct dns_slot))) == NULL)) {
+		addr = dns_lookup(rhost);
+		trace_end_rc(options, span, addr ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL);
+		return addr;
+	}
+
+	slot = &dns_table[dns_hash(rhost) % DNS_CACHE_SLOTS];
+	if (dns_cache_get(slot, rhost, &addr)) {
+		DBGLOG("resolver cache hit for %s", rhost);
+		trace_attr(options, span, "cache", "hit");
+		trace_end(options, span);
+		return addr;
+	}
+
+	trace_attr(options, span, "cache", "miss");
+	addr = dns_lookup(rhost);
+	if (addr != NULL)
+		dns_cache_put(slot, rhost, addr, options->dns_cache_ttl);
+	else if (options->dns_negative_ttl > 0)
+		dns_cache_put(slot, rhost, NULL, options->dns_negative_ttl);
+	trace_end_rc(options, span, addr ? PAM_SUCCESS : PAM_AUTHINFO_UNAVAIL);
+	return addr;
+}
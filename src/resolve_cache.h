@@ -0,0 +1,9 @@
+#ifndef __PAM_PGSQL_RESOLVE_CACHE_H
+#define __PAM_PGSQL_RESOLVE_CACHE_H
+
+#include <stddef.h>
+#include "pam_pgsql_options.h"
+
+char * resolve_rhost(modopt_t *options, const char *rhost);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Local session registry for max_sessions.  pam_sm_open_session() adds
+ * an entry (user, pid of the calling process) to a table in shared
+ * memory, pam_sm_close_session() removes it again and
+ * pam_sm_acct_mgmt() counts the entries of the user.  Entries whose
+ * process is gone are swept whenever their set is looked at, so a
+ * session that was never closed doesn't count for long.
+ *
+ * A user's entries live in the SESSION_PROBES sets of SESSION_WAYS slots
+ * following the hash of the name, so one user can hold up to
+ * SESSION_PROBES * SESSION_WAYS sessions.  session_open() counts the
+ * user's sessions and adds the new one under the table lock, so that
+ * concurrent logins can't all slip in under max_sessions.  A session
+ * that can't be recorded (no free slot, a name too long, no table shared
+ * by root) is refused when max_sessions is set, it couldn't be counted.
+ * Every
+ * session_sync_interval seconds the number of sessions per user is
+ * written with session_sync_query, where %V becomes a VALUES list of
+ * (user, sessions) rows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <libpq-fe.h>
+
+#include "pam_pgsql.h"
+#include "backend_pgsql.h"
+#include "sessions.h"
+#include "shm.h"
+
+#define SESSIONS_SHM      "/pam_pgsql_sessions"
+#define SESSION_SETS      1024
+#define SESSION_WAYS      16
+#define SESSION_PROBES    8
+#define SESSION_USERLEN   64
+
+struct session {
+	pid_t pid;		/* 0 when free */
+	time_t since;
+	char user[SESSION_USERLEN];
+};
+
+struct session_table {
+	pid_t lock;
+	time_t synced;
+	struct session slot[SESSION_SETS * SESSION_WAYS];
+};
+
+static struct session_table *sessions = NULL;
+
+/* private: the user's first set, -1 when there is no table */
+static int
+session_set(const char *user)
+{
+	unsigned int h = 2166136261u;
+
+	/* a table of our own would count nobody else's sessions */
+	if (sessions == NULL &&
+	    (sessions = shm_attach_strict(SESSIONS_SHM, sizeof(struct session_table))) == NULL)
+		return -1;
+	while (*user) {
+		h ^= (unsigned char) *user++;
+		h *= 16777619u;
+	}
+	return h % SESSION_SETS;
+}
+
+/* private: the i-th slot of the sets of the user starting at set */
+static struct session *
+session_slot(int set, int i)
+{
+	return &sessions->slot[((set + i / SESSION_WAYS) % SESSION_SETS) * SESSION_WAYS + i % SESSION_WAYS];
+}
+
+/* private: is the process of a used slot gone? */
+static int
+session_dead(const struct session *s)
+{
+	return kill(s->pid, 0) < 0 && errno == ESRCH;
+}
+
+/* private: free the slots of dead processes */
+static void
+session_sweep(struct session *s, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (s[i].pid != 0 && session_dead(&s[i]))
+			s[i].pid = 0;
+}
+
+/* private: live sessions of the user, called with the lock held */
+static int
+session_live(int set, const char *user)
+{
+	struct session *s;
+	int i, n = 0;
+
+	/* only the user's own entries are checked for dead processes */
+	for (i = 0; i < SESSION_PROBES * SESSION_WAYS; i++) {
+		s = session_slot(set, i);
+		if (s->pid != 0 && !strcmp(s->user, user)) {
+			if (session_dead(s))
+				s->pid = 0;
+			else
+				n++;
+		}
+	}
+	return n;
+}
+
+/* private: order (live) slots by user, free ones last */
+static int
+session_cmp(const void *a, const void *b)
+{
+	const struct session *x = a, *y = b;
+
+	if (x->pid == 0 || y->pid == 0)
+		return (x->pid == 0) - (y->pid == 0);
+	return strcmp(x->user, y->user);
+}
+
+/* private: write the sessions per user with session_sync_query */
+static void
+session_sync(modopt_t *options)
+{
+	struct session *copy;
+	char **params, *sql, *p, *counts;
+	const char *v;
+	PGconn *conn;
+	PGresult *res;
+	int nslots = SESSION_SETS * SESSION_WAYS, n, i, j, expanded = 0;
+
+	/* liveness is checked on the copy, not while everybody waits for the lock */
+	copy = malloc(sizeof(sessions->slot));
+	shm_lock(&sessions->lock);
+	memcpy(copy, sessions->slot, sizeof(sessions->slot));
+	shm_unlock(&sessions->lock);
+	session_sweep(copy, nslots);
+
+	/* one (user, count) row per user, runs of equal names after sorting */
+	qsort(copy, nslots, sizeof(struct session), session_cmp);
+	params = malloc(2 * nslots * sizeof(char *));
+	counts = malloc(nslots * 12);
+	for (n = 0, i = 0; i < nslots && copy[i].pid != 0; i = j, n++) {
+		for (j = i; j < nslots && copy[j].pid != 0 && !strcmp(copy[i].user, copy[j].user); j++)
+			;
+		params[2 * n] = copy[i].user;
+		params[2 * n + 1] = counts + 12 * n;
+		sprintf(params[2 * n + 1], "%d", j - i);
+	}
+
+	/* %V -> VALUES (...), (...); a NULL row keeps it valid without sessions */
+	sql = malloc(strlen(options->session_sync_query) + (n ? n : 1) * 40 + 16);
+	for (p = sql, v = options->session_sync_query; *v; v++) {
+		if (v[0] == '%' && v[1] == 'V' && !expanded++) {
+			p += sprintf(p, "VALUES ");
+			if (n == 0)
+				p += sprintf(p, "(NULL::text, 0)");
+			for (i = 0; i < n; i++)
+				p += sprintf(p, "%s($%d::text, $%d::integer)", i ? ", " : "", 2 * i + 1, 2 * i + 2);
+			v++;
+		} else {
+			*p++ = *v;
+		}
+	}
+	*p = '\0';
+
+	DBGLOG("syncing sessions of %d users: %s", n, options->session_sync_query);
+	if ((conn = db_connect(options)) != NULL) {
+		res = PQexecParams(conn, sql, 2 * n, NULL, (const char **) params, NULL, NULL, 0);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK)
+			SYSLOG("PostgreSQL query failed: '%s'", PQresultErrorMessage(res));
+		PQclear(res);
+		db_release(options, conn);
+	}
+
+	free(sql);
+	free(counts);
+	free(params);
+	free(copy);
+}
+
+/* private: sync if session_sync_interval has passed, the caller that notices does it */
+static void
+session_sync_due(modopt_t *options)
+{
+	time_t now = time(NULL), synced;
+
+	if (options->session_sync_query == NULL)
+		return;
+	synced = __atomic_load_n(&sessions->synced, __ATOMIC_RELAXED);
+	if (now - synced >= options->session_sync_interval &&
+	    __atomic_compare_exchange_n(&sessions->synced, &synced, now, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		session_sync(options);
+}
+
+/*
+ * record a session of user, PAM_SESSION_ERR if that isn't possible or
+ * the user already has max_sessions
+ */
+int
+session_open(modopt_t *options, const char *user)
+{
+	struct session *s = NULL;
+	int set, i, swept;
+
+	if (user == NULL || strlen(user) >= SESSION_USERLEN || (set = session_set(user)) < 0) {
+		SYSLOG("session of %s can't be recorded", user ? user : "(none)");
+		return PAM_SESSION_ERR;
+	}
+
+	shm_lock(&sessions->lock);
+	if (options->max_sessions > 0 && session_live(set, user) >= options->max_sessions) {
+		shm_unlock(&sessions->lock);
+		SYSLOG("user %s already has %d sessions", user, options->max_sessions);
+		return PAM_SESSION_ERR;
+	}
+
+	/* first a free slot, only if there is none look for dead processes */
+	for (swept = 0; swept < 2 && s == NULL; swept++) {
+		if (swept)
+			for (i = 0; i < SESSION_PROBES; i++)
+				session_sweep(session_slot(set, i * SESSION_WAYS), SESSION_WAYS);
+		for (i = 0; i < SESSION_PROBES * SESSION_WAYS && s == NULL; i++)
+			if (session_slot(set, i)->pid == 0)
+				s = session_slot(set, i);
+	}
+	if (s != NULL) {
+		s->pid = getpid();
+		s->since = time(NULL);
+		strcpy(s->user, user);
+	}
+	shm_unlock(&sessions->lock);
+
+	if (s == NULL)
+		SYSLOG("session table full, session of %s not recorded", user);
+	session_sync_due(options);
+	return s != NULL ? PAM_SUCCESS : PAM_SESSION_ERR;
+}
+
+void
+session_close(modopt_t *options, const char *user)
+{
+	struct session *s;
+	int set, i;
+
+	if (user == NULL || strlen(user) >= SESSION_USERLEN || (set = session_set(user)) < 0)
+		return;
+
+	/* one session per call, a process may have opened several */
+	shm_lock(&sessions->lock);
+	for (i = 0; i < SESSION_PROBES * SESSION_WAYS; i++) {
+		s = session_slot(set, i);
+		if (s->pid == getpid() && !strcmp(s->user, user)) {
+			s->pid = 0;
+			break;
+		}
+	}
+	shm_unlock(&sessions->lock);
+	session_sync_due(options);
+}
+
+/* sessions of user, -1 when they can't be counted */
+int
+session_count(modopt_t *options, const char *user)
+{
+	int set, n;
+
+	if (user == NULL || (set = session_set(user)) < 0)
+		return -1;
+
+	shm_lock(&sessions->lock);
+	n = session_live(set, user);
+	shm_unlock(&sessions->lock);
+	return n;
+}
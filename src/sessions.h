@@ -0,0 +1,10 @@
+#ifndef __PAM_PGSQL_SESSIONS_H
+#define __PAM_PGSQL_SESSIONS_H
+
+#include "pam_pgsql_options.h"
+
+int session_open(modopt_t *options, const char *user);
+void session_close(modopt_t *options, const char *user);
+int session_count(modopt_t *options, const char *user);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Small helper to map the fixed-size tables the module shares between
+ * processes (caches, counters).  Segments are only created by root, with
+ * mode 0600, and only root-owned ones are used: a segment anybody else
+ * put there first is replaced.  Other callers (the tools, services that
+ * don't run as root) just attach to what root created.  When sharing
+ * isn't possible shm_attach() falls back to anonymous memory so that the
+ * callers can always assume they got a zeroed table back, and
+ * shm_attach_strict() returns NULL for the tables that are useless
+ * unless shared.
+ *
+ * Tables that need more than the lock-free tricks of their users can
+ * take shm_lock(), a spin lock holding the pid of its owner.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "shm.h"
+#include "pam_pgsql.h"
+
+/* private: anonymous mapping, shared with our own children only */
+static void *
+shm_private(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/* private: the shared segment, NULL if there is no usable one */
+static void *
+shm_map(const char *name, size_t size)
+{
+	struct stat st;
+	void *p;
+	int fd, tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (geteuid() == 0 && (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0) {
+			if (ftruncate(fd, size) != 0) {
+				close(fd);
+				shm_unlink(name);
+				return NULL;
+			}
+		} else if (geteuid() == 0 && errno != EEXIST) {
+			return NULL;
+		} else if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+			return NULL;
+		} else if (fstat(fd, &st) != 0 || st.st_uid != 0 ||
+		           (st.st_mode & 077) != 0 || st.st_size != (off_t) size) {
+			/* never trust a segment somebody else could have prepared for us */
+			SYSLOG("shared memory segment %s has a bad owner, mode or size", name);
+			close(fd);
+			if (geteuid() != 0)
+				return NULL;
+			shm_unlink(name);
+			continue;
+		}
+
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		return (p == MAP_FAILED) ? NULL : p;
+	}
+	return NULL;
+}
+
+void *
+shm_attach(const char *name, size_t size)
+{
+	void *p;
+
+	return (p = shm_map(name, size)) != NULL ? p : shm_private(size);
+}
+
+/* like shm_attach(), but NULL instead of memory only we can see */
+void *
+shm_attach_strict(const char *name, size_t size)
+{
+	return shm_map(name, size);
+}
+
+/*
+ * Critical sections under the lock are short and never block, so
+ * waiters spin; a holder that died in one is detected by its pid.
+ */
+void
+shm_lock(pid_t *lock)
+{
+	pid_t owner;
+	int spins = 0;
+
+	for (;;) {
+		owner = 0;
+		if (__atomic_compare_exchange_n(lock, &owner, getpid(), 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		if (++spins < 1000)
+			continue;
+		if (owner != 0 && kill(owner, 0) < 0 && errno == ESRCH)
+			__atomic_compare_exchange_n(lock, &owner, 0, 0,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		spins = 0;
+		sched_yield();
+	}
+}
+
+void
+shm_unlock(pid_t *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
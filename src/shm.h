@@ -0,0 +1,12 @@
+#ifndef __PAM_PGSQL_SHM_H
+#define __PAM_PGSQL_SHM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+void * shm_attach(const char *name, size_t size);
+void * shm_attach_strict(const char *name, size_t size);
+void shm_lock(pid_t *lock);
+void shm_unlock(pid_t *lock);
+
+#endif
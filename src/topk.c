@@ -0,0 +1,202 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Heavy hitters: the users, client hosts and (user, host) pairs with the
+ * most successful and the most failed logins, found with the
+ * Space-Saving algorithm (Metwally, Agrawal, El Abbadi).  Each of the six
+ * sketches keeps TOPK_COUNTERS counters in shared memory; a key that
+ * isn't counted yet takes over the smallest counter, whose count it
+ * inherits as its possible overcount ("error").  Any key with more than
+ * 1/TOPK_COUNTERS of the logins of a window is guaranteed to be listed.
+ *
+ * Counts are kept for the current and the previous window of
+ * heavy_hitters_window seconds; pam_pgsql_stat prints them.  Keys are
+ * stored with spaces, backslashes and control characters written as
+ * \xNN, so they print safely and the space in "user host" is the only one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "pam_pgsql.h"
+#include "topk.h"
+#include "shm.h"
+
+#define TOPK_SHM        "/pam_pgsql_topk"
+#define TOPK_COUNTERS   64
+#define TOPK_KEYLEN     128
+#define TOPK_SKETCHES   6
+
+struct topk_counter {
+	unsigned int count;
+	unsigned int error;
+	char key[TOPK_KEYLEN];
+};
+
+struct topk_window {
+	time_t start;
+	struct topk_counter c[TOPK_COUNTERS];
+};
+
+struct topk_sketch {
+	int cur;
+	struct topk_window w[2];
+};
+
+struct topk_table {
+	pid_t lock;
+	struct topk_sketch sketch[TOPK_SKETCHES];
+};
+
+static const char *topk_names[TOPK_SKETCHES] = {
+	"users, successful logins", "users, failed logins",
+	"hosts, successful logins", "hosts, failed logins",
+	"user from host, successful logins", "user from host, failed logins"
+};
+
+static struct topk_table *topk = NULL;
+
+static struct topk_table *
+topk_table(void)
+{
+	if (topk == NULL)
+		topk = shm_attach(TOPK_SHM, sizeof(struct topk_table));
+	return topk;
+}
+
+/* private: count one login of key, called with the lock held */
+static void
+topk_add(struct topk_sketch *s, const char *key, int window, time_t now)
+{
+	struct topk_window *w;
+	struct topk_counter *c, *min;
+	int i;
+
+	w = &s->w[s->cur];
+	if (now - w->start >= window) {
+		/* after a quiet spell the previous window is stale as well */
+		if (now - w->start >= 2 * window)
+			memset(w, 0, sizeof(*w));
+		s->cur ^= 1;
+		w = &s->w[s->cur];
+		memset(w, 0, sizeof(*w));
+		w->start = now;
+	}
+
+	min = &w->c[0];
+	for (i = 0; i < TOPK_COUNTERS; i++) {
+		c = &w->c[i];
+		if (c->count > 0 && !strcmp(c->key, key)) {
+			c->count++;
+			return;
+		}
+		if (c->count < min->count)
+			min = c;
+	}
+	min->error = min->count;
+	min->count++;
+	strncpy(min->key, key, TOPK_KEYLEN - 1);
+	min->key[TOPK_KEYLEN - 1] = '\0';
+}
+
+/* private: copy s to dst, escaped as a key, cut short rather than mid escape */
+static void
+topk_escape(char *dst, size_t size, const char *s)
+{
+	unsigned char c;
+	size_t n = 0;
+
+	for (; (c = *s) != '\0'; s++) {
+		if (c < 0x20 || c == 0x7f || c == ' ' || c == '\\') {
+			if (n + 4 >= size)
+				break;
+			n += sprintf(dst + n, "\\x%02x", c);
+		} else {
+			if (n + 1 >= size)
+				break;
+			dst[n++] = c;
+		}
+	}
+	dst[n] = '\0';
+}
+
+/* count a login of user from rhost, rc is its PAM result */
+void
+topk_record(modopt_t *options, const char *user, const char *rhost, int rc)
+{
+	struct topk_table *t;
+	char ukey[TOPK_KEYLEN], hkey[TOPK_KEYLEN], pair[TOPK_KEYLEN];
+	time_t now = time(NULL);
+	int failed = (rc != PAM_SUCCESS);
+	size_t len;
+
+	if (!options->heavy_hitters || user == NULL || (t = topk_table()) == NULL)
+		return;
+
+	topk_escape(ukey, sizeof(ukey), user);
+	shm_lock(&t->lock);
+	topk_add(&t->sketch[0 + failed], ukey, options->heavy_hitters_window, now);
+	if (rhost != NULL && *rhost) {
+		topk_escape(hkey, sizeof(hkey), rhost);
+		/* the user gets at most half of the pair, the host what is left */
+		topk_escape(pair, sizeof(pair) / 2, user);
+		len = strlen(pair);
+		pair[len++] = ' ';
+		topk_escape(pair + len, sizeof(pair) - len, rhost);
+		topk_add(&t->sketch[2 + failed], hkey, options->heavy_hitters_window, now);
+		topk_add(&t->sketch[4 + failed], pair, options->heavy_hitters_window, now);
+	}
+	shm_unlock(&t->lock);
+}
+
+/* private: biggest counts first */
+static int
+topk_cmp(const void *a, const void *b)
+{
+	const struct topk_counter *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static void
+topk_print(FILE *fp, const char *title, struct topk_window *w, int limit)
+{
+	char when[32];
+	int i;
+
+	if (w->start == 0)
+		return;
+	qsort(w->c, TOPK_COUNTERS, sizeof(struct topk_counter), topk_cmp);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&w->start));
+	fprintf(fp, "%s, since %s:\n", title, when);
+	for (i = 0; i < TOPK_COUNTERS && i < limit && w->c[i].count > 0; i++) {
+		if (w->c[i].error)
+			fprintf(fp, "  %10u (-%u) %s\n", w->c[i].count, w->c[i].error, w->c[i].key);
+		else
+			fprintf(fp, "  %10u %s\n", w->c[i].count, w->c[i].key);
+	}
+}
+
+int
+topk_dump(FILE *fp, int limit)
+{
+	struct topk_table *t, copy;
+	struct topk_sketch *s;
+	int i;
+
+	if ((t = topk_table()) == NULL)
+		return -1;
+	shm_lock(&t->lock);
+	memcpy(&copy, t, sizeof(copy));
+	shm_unlock(&t->lock);
+
+	for (i = 0; i < TOPK_SKETCHES; i++) {
+		s = &copy.sketch[i];
+		topk_print(fp, topk_names[i], &s->w[s->cur], limit);
+		topk_print(fp, topk_names[i], &s->w[s->cur ^ 1], limit);
+	}
+	return 0;
+}
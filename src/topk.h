@@ -0,0 +1,10 @@
+#ifndef __PAM_PGSQL_TOPK_H
+#define __PAM_PGSQL_TOPK_H
+
+#include <stdio.h>
+#include "pam_pgsql_options.h"
+
+void topk_record(modopt_t *options, const char *user, const char *rhost, int rc);
+int topk_dump(FILE *fp, int limit);
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Tracing.  With trace_file set, trace_sample percent of the PAM calls
+ * are recorded as a trace: a root span for the call with child spans
+ * for loading the options, DNS, connecting, every query, password
+ * hashing and so on.  When the call is done the trace is appended to
+ * trace_file as one line of OTLP/JSON (an ExportTraceServiceRequest, as
+ * the OpenTelemetry collector's file receiver reads it); the file is
+ * moved to trace_file.1 once it grows past trace_file_size bytes.
+ *
+ * A W3C TRACEPARENT in the PAM environment makes the call part of that
+ * trace.  Queries carry the trace in a leading comment, so statements in
+ * the PostgreSQL logs can be matched with their span.
+ *
+ * The same spans feed the flight recorder (flight.c) and the per phase
+ * statistics (phase_stats.c), which is why all calls get a trace when
+ * one of them is on; only sampled ones are written out.  Spans are
+ * timed with the monotonic clock, so a clock step can't turn durations
+ * negative; only the start of the call is taken from the wall clock.
+ * Spans also take the CPU time of the thread, so that the time spent
+ * waiting (network, database, locks) can be told from the time spent
+ * computing (hashing, TLS).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <gcrypt.h>
+
+#include "pam_pgsql.h"
+#include "trace.h"
+#include "flight.h"
+#include "phase_stats.h"
+
+#define TRACE_SPANS   64
+
+struct trace_span {
+	const char *name;
+	unsigned long long start, end;	/* CLOCK_MONOTONIC */
+	unsigned long long cpu_start, cpu_end;
+	unsigned char id[8];
+	int parent;
+	int error;
+	char *attrs;		/* JSON key/value objects, comma separated */
+};
+
+struct trace_s {
+	int sampled;
+	unsigned char id[16];
+	unsigned char parent_id[8];	/* from TRACEPARENT */
+	int remote_parent;
+	unsigned long long wall_start;	/* CLOCK_REALTIME at the start of the root span */
+	int current;
+	int nspans;
+	char comment[80];
+	char host[48];		/* first database server talked to */
+	char service[24];
+	int dns_cache;		/* see struct flight_event */
+	struct trace_span span[TRACE_SPANS];
+};
+
+static unsigned long long
+trace_ns(const struct timespec *ts)
+{
+	return (unsigned long long) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void
+trace_hex(char *out, const unsigned char *in, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+/* private: n bytes of hex into out, 0 if that isn't what is there */
+static int
+trace_unhex(unsigned char *out, const char *in, int n)
+{
+	unsigned int b;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (sscanf(in + 2 * i, "%2x", &b) != 1)
+			return 0;
+		out[i] = b;
+	}
+	return 1;
+}
+
+void
+trace_clock(trace_time_t *now)
+{
+	clock_gettime(CLOCK_REALTIME, &now->wall);
+	clock_gettime(CLOCK_MONOTONIC, &now->mono);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now->cpu);
+}
+
+void
+trace_start(modopt_t *options, const char *name, const trace_time_t *since, const char *traceparent)
+{
+	struct trace_s *t;
+	unsigned char coin;
+	char tid[33], sid[17];
+	int root, sampled;
+
+	if (options == NULL || options->trace != NULL)
+		return;
+
+	/* head sampling: the whole call is traced or none of it */
+	sampled = 0;
+	if (options->trace_file != NULL) {
+		gcry_create_nonce(&coin, 1);
+		sampled = coin * 100 < options->trace_sample * 256;
+	}
+	if (!sampled && !options->flight_recorder && !options->phase_stats)
+		return;
+
+	t = calloc(1, sizeof(struct trace_s));
+	t->sampled = sampled;
+	t->current = -1;
+	/* version 00: "00-<32 hex trace id>-<16 hex span id>-<flags>" */
+	if (traceparent != NULL && strlen(traceparent) >= 55 && !strncmp(traceparent, "00-", 3) &&
+	    trace_unhex(t->id, traceparent + 3, 16) && trace_unhex(t->parent_id, traceparent + 36, 8))
+		t->remote_parent = 1;
+	else if (sampled)
+		gcry_create_nonce(t->id, sizeof(t->id));
+	options->trace = t;
+
+	root = trace_span(options, name);
+	t->wall_start = trace_ns(&since->wall);
+	t->span[root].start = trace_ns(&since->mono);
+	t->span[root].cpu_start = trace_ns(&since->cpu);
+	trace_end(options, trace_span(options, "options"));
+	t->span[root + 1].start = trace_ns(&since->mono);
+	t->span[root + 1].cpu_start = trace_ns(&since->cpu);
+
+	if (sampled) {
+		trace_hex(tid, t->id, 16);
+		trace_hex(sid, t->span[root].id, 8);
+		snprintf(t->comment, sizeof(t->comment), "/* traceparent='00-%s-%s-01' */ ", tid, sid);
+	}
+}
+
+int
+trace_span(modopt_t *options, const char *name)
+{
+	struct trace_s *t;
+	struct trace_span *s;
+	trace_time_t now;
+
+	if (options == NULL || (t = options->trace) == NULL || t->nspans == TRACE_SPANS)
+		return -1;
+
+	s = &t->span[t->nspans];
+	s->name = name;
+	s->parent = t->current;
+	if (t->sampled)
+		gcry_create_nonce(s->id, sizeof(s->id));
+	trace_clock(&now);
+	s->start = trace_ns(&now.mono);
+	s->cpu_start = trace_ns(&now.cpu);
+	t->current = t->nspans;
+	return t->nspans++;
+}
+
+/* private: add a ready made JSON value to the span */
+static void
+trace_attr_json(modopt_t *options, int span, const char *key, const char *value)
+{
+	struct trace_span *s;
+	size_t len;
+
+	if (span < 0 || options == NULL || options->trace == NULL || !options->trace->sampled)
+		return;
+	s = &options->trace->span[span];
+	len = s->attrs ? strlen(s->attrs) : 0;
+	s->attrs = realloc(s->attrs, len + strlen(key) + strlen(value) + 32);
+	sprintf(s->attrs + len, "%s{\"key\":\"%s\",\"value\":%s}", len ? "," : "", key, value);
+}
+
+void
+trace_attr(modopt_t *options, int span, const char *key, const char *value)
+{
+	struct trace_s *t;
+	char *json, *p;
+
+	if (span < 0 || options == NULL || (t = options->trace) == NULL || value == NULL)
+		return;
+
+	/* what the flight recorder keeps of the attributes */
+	if (!strcmp(key, "server.address") && t->host[0] == '\0')
+		snprintf(t->host, sizeof(t->host), "%s", value);
+	else if (!strcmp(key, "pam.service"))
+		snprintf(t->service, sizeof(t->service), "%s", value);
+	else if (!strcmp(key, "cache"))
+		t->dns_cache = strcmp(value, "hit") ? 2 : 1;
+	if (!t->sampled)
+		return;
+
+	/* {"stringValue":"..."} with the value escaped for JSON */
+	p = json = malloc(strlen(value) * 6 + 20);
+	p += sprintf(p, "{\"stringValue\":\"");
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\')
+			p += sprintf(p, "\\%c", *value);
+		else if ((unsigned char) *value < 0x20)
+			p += sprintf(p, "\\u%04x", (unsigned char) *value);
+		else
+			*p++ = *value;
+	}
+	strcpy(p, "\"}");
+	trace_attr_json(options, span, key, json);
+	free(json);
+}
+
+void
+trace_attr_int(modopt_t *options, int span, const char *key, long value)
+{
+	char json[48];
+
+	snprintf(json, sizeof(json), "{\"intValue\":\"%ld\"}", value);
+	trace_attr_json(options, span, key, json);
+}
+
+void
+trace_end_rc(modopt_t *options, int span, int rc)
+{
+	struct trace_s *t;
+	trace_time_t now;
+
+	if (span < 0 || options == NULL || (t = options->trace) == NULL)
+		return;
+	trace_clock(&now);
+	t->span[span].end = trace_ns(&now.mono);
+	t->span[span].cpu_end = trace_ns(&now.cpu);
+	t->span[span].error = (rc != PAM_SUCCESS);
+	t->current = t->span[span].parent;
+}
+
+void
+trace_end(modopt_t *options, int span)
+{
+	trace_end_rc(options, span, PAM_SUCCESS);
+}
+
+const char *
+trace_comment(modopt_t *options)
+{
+	return (options != NULL && options->trace != NULL) ? options->trace->comment : "";
+}
+
+/* private: hand the call over to the flight recorder */
+static void
+trace_flight(struct trace_s *t, int rc)
+{
+	struct flight_event e;
+	int i;
+
+	memset(&e, 0, sizeof(e));
+	e.start_us = t->wall_start / 1000;
+	e.pid = getpid();
+	e.rc = rc;
+	e.call = flight_name(t->span[0].name);
+	e.error = FLIGHT_NONE;
+	e.dns_cache = t->dns_cache;
+	memcpy(e.host, t->host, sizeof(e.host));
+	memcpy(e.service, t->service, sizeof(e.service));
+	for (i = 1; i < t->nspans; i++) {
+		if (t->span[i].error && e.error == FLIGHT_NONE)
+			e.error = flight_name(t->span[i].name);
+		if (e.nphases == FLIGHT_PHASES)
+			continue;
+		e.phase[e.nphases].name = flight_name(t->span[i].name);
+		e.phase[e.nphases].failed = t->span[i].error;
+		e.phase[e.nphases].start_us = (t->span[i].start - t->span[0].start) / 1000;
+		e.phase[e.nphases].wall_us = (t->span[i].end - t->span[i].start) / 1000;
+		e.phase[e.nphases].cpu_us = (t->span[i].cpu_end - t->span[i].cpu_start) / 1000;
+		e.nphases++;
+	}
+	flight_put(&e);
+}
+
+/*
+ * private: append the line to the trace file, rotating it when it got too
+ * big.  Of the processes that find it too big, the first one to get the
+ * lock renames it; the others see that the name is no longer the file
+ * they opened and just open it again.
+ */
+static void
+trace_write(modopt_t *options, const char *line, size_t len)
+{
+	struct stat st, cur;
+	char *old;
+	int fd;
+
+	if ((fd = open(options->trace_file, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW, 0600)) < 0)
+		return;
+	if (fstat(fd, &st) == 0 && options->trace_file_size > 0 && st.st_size + len > options->trace_file_size) {
+		flock(fd, LOCK_EX);
+		if (lstat(options->trace_file, &cur) == 0 && cur.st_dev == st.st_dev && cur.st_ino == st.st_ino) {
+			old = malloc(strlen(options->trace_file) + 3);
+			sprintf(old, "%s.1", options->trace_file);
+			rename(options->trace_file, old);
+			free(old);
+		}
+		flock(fd, LOCK_UN);
+		close(fd);
+		if ((fd = open(options->trace_file, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW, 0600)) < 0)
+			return;
+	}
+	if (write(fd, line, len) != (ssize_t) len)
+		SYSLOG("could not write trace to %s", options->trace_file);
+	close(fd);
+}
+
+void
+trace_finish(modopt_t *options, int rc)
+{
+	struct trace_s *t;
+	struct trace_span *s;
+	char tid[33], sid[17], pid[17], *line;
+	size_t len;
+	FILE *fp;
+	int i;
+
+	if (options == NULL || (t = options->trace) == NULL)
+		return;
+
+	/* whatever is still open ends now, the root with the result */
+	while (t->current > 0)
+		trace_end(options, t->current);
+	trace_attr_int(options, 0, "pam.result", rc);
+	trace_end_rc(options, 0, rc);
+
+	if (options->flight_recorder)
+		trace_flight(t, rc);
+	if (options->phase_stats)
+		for (i = 0; i < t->nspans; i++)
+			phase_stats_add(flight_name(t->span[i].name),
+			    (t->span[i].end - t->span[i].start) / 1000,
+			    (t->span[i].cpu_end - t->span[i].cpu_start) / 1000);
+
+	trace_hex(tid, t->id, 16);
+	if (t->sampled)
+		DBGLOG("trace %s", tid);
+
+	if (t->sampled && (fp = open_memstream(&line, &len)) != NULL) {
+		fprintf(fp, "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+		    "{\"key\":\"service.name\",\"value\":{\"stringValue\":\"pam_pgsql\"}}]},"
+		    "\"scopeSpans\":[{\"scope\":{\"name\":\"pam_pgsql\"},\"spans\":[");
+		for (i = 0; i < t->nspans; i++) {
+			s = &t->span[i];
+			trace_hex(sid, s->id, 8);
+			if (s->parent >= 0)
+				trace_hex(pid, t->span[s->parent].id, 8);
+			else if (t->remote_parent)
+				trace_hex(pid, t->parent_id, 8);
+			else
+				pid[0] = '\0';
+			fprintf(fp, "%s{\"traceId\":\"%s\",\"spanId\":\"%s\",\"parentSpanId\":\"%s\","
+			    "\"name\":\"%s\",\"kind\":%d,\"startTimeUnixNano\":\"%llu\",\"endTimeUnixNano\":\"%llu\","
+			    "\"attributes\":[%s],\"status\":{\"code\":%d}}",
+			    i ? "," : "", tid, sid, pid, s->name, i == 0 ? 2 : 1,
+			    t->wall_start + (s->start - t->span[0].start),
+			    t->wall_start + ((s->end ? s->end : s->start) - t->span[0].start),
+			    s->attrs ? s->attrs : "", s->error ? 2 : 0);
+		}
+		fprintf(fp, "]}]}]}\n");
+		fclose(fp);
+		trace_write(options, line, len);
+		free(line);
+	}
+
+	for (i = 0; i < t->nspans; i++)
+		free(t->span[i].attrs);
+	free(t);
+	options->trace = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef __PAM_PGSQL_TRACE_H
+#define __PAM_PGSQL_TRACE_H
+
+#include <time.h>
+#include "pam_pgsql_options.h"
+
+/*
+ * wall clock (only for timestamps), monotonic clock (for durations, a
+ * clock step mustn't make them negative) and CPU time of the thread
+ */
+typedef struct {
+	struct timespec wall;
+	struct timespec mono;
+	struct timespec cpu;
+} trace_time_t;
+
+void trace_clock(trace_time_t *now);
+void trace_start(modopt_t *options, const char *name, const trace_time_t *since, const char *traceparent);
+int trace_span(modopt_t *options, const char *name);
+void trace_attr(modopt_t *options, int span, const char *key, const char *value);
+void trace_attr_int(modopt_t *options, int span, const char *key, long value);
+void trace_end(modopt_t *options, int span);
+void trace_end_rc(modopt_t *options, int span, int rc);
+const char * trace_comment(modopt_t *options);
+void trace_finish(modopt_t *options, int rc);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * User filter: with user_filter set, pam_sm_authenticate() refuses
+ * users that are not in the filter built by pam_pgsql_userfilter from
+ * all user names in the database, without connecting to it.  The filter
+ * is a blocked Bloom filter: a name sets k bits in one block of
+ * USERFILTER_BLOCK bytes (a cache line), so a check reads a single
+ * block.  A name that was never added is let through with the false
+ * positive rate the filter was sized for; one that was is never refused.
+ * Names are compared byte for byte, as given to PAM.
+ *
+ * The file is mapped and kept for the lifetime of the process, and
+ * mapped again when it is replaced.  Names added in place are seen
+ * right away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pam_pgsql.h"
+#include "userfilter.h"
+
+struct userfilter {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	const unsigned char *map;
+	unsigned long long nblocks;
+	int k;
+	int refs;
+	int stale;
+	struct userfilter *next;
+};
+
+static pthread_mutex_t userfilter_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct userfilter *userfilters = NULL;
+
+static unsigned long long
+be64(const unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* private: 64 bit FNV-1a with a final mix, seeded */
+static unsigned long long
+userfilter_hash(const char *user, unsigned long long seed)
+{
+	unsigned long long h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+
+	while (*user) {
+		h ^= (unsigned char) *user++;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * set the k bits of user; the block comes from a hash of its own, so that
+ * names in the same block don't share their bit patterns as well
+ */
+void
+userfilter_add(unsigned char *blocks, unsigned long long nblocks, int k, const char *user)
+{
+	unsigned long long h = userfilter_hash(user, 0);
+	unsigned char *b = blocks + userfilter_hash(user, 1) % nblocks * USERFILTER_BLOCK;
+	unsigned int h1 = (unsigned int) h, h2 = (unsigned int) (h >> 32) | 1, bit;
+	int i;
+
+	for (i = 0; i < k; i++) {
+		bit = (h1 + i * h2) % (USERFILTER_BLOCK * 8);
+		b[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+/* 0 if user was certainly never added */
+int
+userfilter_test(const unsigned char *blocks, unsigned long long nblocks, int k, const char *user)
+{
+	unsigned long long h = userfilter_hash(user, 0);
+	const unsigned char *b = blocks + userfilter_hash(user, 1) % nblocks * USERFILTER_BLOCK;
+	unsigned int h1 = (unsigned int) h, h2 = (unsigned int) (h >> 32) | 1, bit;
+	int i;
+
+	for (i = 0; i < k; i++) {
+		bit = (h1 + i * h2) % (USERFILTER_BLOCK * 8);
+		if (!(b[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+userfilter_free(struct userfilter *f)
+{
+	munmap((void *) f->map, f->size);
+	free(f->path);
+	free(f);
+}
+
+/* private: map and sanity check the filter */
+static struct userfilter *
+userfilter_open(modopt_t *options, const char *path, struct stat *st)
+{
+	struct userfilter *f;
+	unsigned char *map;
+	unsigned long long nblocks = 0, k = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	map = st->st_size >= USERFILTER_HEADER ? mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map != MAP_FAILED) {
+		nblocks = be64(map + 8);
+		k = be64(map + 16);
+	}
+	if (map == MAP_FAILED || memcmp(map, USERFILTER_MAGIC, 8) != 0 || nblocks == 0 || k == 0 || k > 64 ||
+	    USERFILTER_HEADER + nblocks * USERFILTER_BLOCK != (unsigned long long) st->st_size) {
+		SYSLOG("%s is not a user filter", path);
+		if (map != MAP_FAILED)
+			munmap(map, st->st_size);
+		return NULL;
+	}
+	madvise(map, st->st_size, MADV_RANDOM);
+
+	f = calloc(1, sizeof(struct userfilter));
+	f->path = strdup(path);
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->size = st->st_size;
+	f->mtime = st->st_mtime;
+	f->map = map;
+	f->nblocks = nblocks;
+	f->k = k;
+	DBGLOG("mapped user filter %s, %llu names", path, be64(map + 24));
+	return f;
+}
+
+/* private: get a reference to the filter, mapping it (again) if needed */
+static struct userfilter *
+userfilter_get(modopt_t *options, const char *path)
+{
+	struct userfilter *f, **pf;
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		SYSLOG("can't use user filter %s", path);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&userfilter_lock);
+	for (pf = &userfilters; (f = *pf) != NULL; pf = &f->next)
+		if (!strcmp(f->path, path))
+			break;
+
+	if (f != NULL && (f->dev != st.st_dev || f->ino != st.st_ino || f->size != st.st_size)) {
+		/* unlink the old version, the last user unmaps it */
+		*pf = f->next;
+		f->stale = 1;
+		if (f->refs == 0)
+			userfilter_free(f);
+		f = NULL;
+	}
+
+	if (f == NULL && (f = userfilter_open(options, path, &st)) != NULL) {
+		f->next = userfilters;
+		userfilters = f;
+	}
+	if (f != NULL)
+		f->refs++;
+	pthread_mutex_unlock(&userfilter_lock);
+
+	return f;
+}
+
+static void
+userfilter_put(struct userfilter *f)
+{
+	pthread_mutex_lock(&userfilter_lock);
+	if (--f->refs == 0 && f->stale)
+		userfilter_free(f);
+	pthread_mutex_unlock(&userfilter_lock);
+}
+
+/* PAM_USER_UNKNOWN if the user_filter says there is no such user */
+int
+userfilter_check(modopt_t *options, const char *user)
+{
+	struct userfilter *f;
+	int found;
+
+	if (options->user_filter == NULL || user == NULL)
+		return PAM_SUCCESS;
+
+	/* without a usable filter everybody is looked up as before */
+	if ((f = userfilter_get(options, options->user_filter)) == NULL)
+		return PAM_SUCCESS;
+
+	found = userfilter_test(f->map + USERFILTER_HEADER, f->nblocks, f->k, user);
+	userfilter_put(f);
+	return found ? PAM_SUCCESS : PAM_USER_UNKNOWN;
+}
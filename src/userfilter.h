@@ -0,0 +1,19 @@
+#ifndef __PAM_PGSQL_USERFILTER_H
+#define __PAM_PGSQL_USERFILTER_H
+
+#include "pam_pgsql_options.h"
+
+/*
+ * Filter file: USERFILTER_MAGIC, the number of blocks, the number of
+ * bits set per name and the number of names added (8 byte big endian),
+ * then the blocks of USERFILTER_BLOCK bytes.
+ */
+#define USERFILTER_MAGIC    "PGUSRF02"
+#define USERFILTER_HEADER   32
+#define USERFILTER_BLOCK    64
+
+void userfilter_add(unsigned char *blocks, unsigned long long nblocks, int k, const char *user);
+int userfilter_test(const unsigned char *blocks, unsigned long long nblocks, int k, const char *user);
+int userfilter_check(modopt_t *options, const char *user);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * PAM authentication module for PostgreSQL
+ *
+ * Write-behind for auth_succ_query/auth_fail_query.  Instead of one row
+ * update per login, the number and time of the last successes and
+ * failures of every user are added up in a table in shared memory and
+ * written every write_behind_interval seconds with one statement per
+ * kind: %V in auth_succ_batch_query/auth_fail_batch_query becomes
+ *
+ *   VALUES ($1::text, $2::integer, to_timestamp($3::bigint)), ...
+ *
+ * with one (user, count, time of the last event) row per user.  The
+ * flush is done by the first login after the interval ran out, so a
+ * lockout counting batched failures lags behind by up to that long.
+ *
+ * Entries are keyed by user and by connection string and batch query,
+ * so every backend and shard only flushes its own users, on its own
+ * timer (a few are kept, one that was evicted is due right away).  A
+ * user can sit in one of WB_PROBES slots after its hash; when all of
+ * them are taken the caller falls back to the plain single-row query.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <libpq-fe.h>
+
+#include "pam_pgsql.h"
+#include "backend_pgsql.h"
+#include "write_behind.h"
+#include "shm.h"
+
+#define WB_SHM       "/pam_pgsql_wb"
+#define WB_SLOTS     4096
+#define WB_PROBES    8
+#define WB_USERLEN   64
+#define WB_BATCH     500
+#define WB_TIMERS    64
+
+struct wb_slot {
+	unsigned int db;	/* hash of connection string and query, 0 when free */
+	int count;
+	time_t last;
+	char user[WB_USERLEN];
+};
+
+struct wb_table {
+	pid_t lock;		/* pid of the holder, 0 when free */
+	struct {
+		unsigned int db;
+		time_t flushed;
+	} timer[WB_TIMERS];
+	struct wb_slot slot[WB_SLOTS];
+};
+
+static struct wb_table *wb = NULL;
+
+/* private: FNV-1a, never 0 */
+static unsigned int
+wb_hash(const char *s, unsigned int h)
+{
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h ? h : 1;
+}
+
+/* private: add events for the user, called with the lock held; 0 if there is no room */
+static int
+wb_add(unsigned int db, const char *user, int count, time_t last)
+{
+	struct wb_slot *s, *empty = NULL;
+	unsigned int h;
+	int i;
+
+	h = wb_hash(user, db);
+	for (i = 0; i < WB_PROBES; i++) {
+		s = &wb->slot[(h + i) % WB_SLOTS];
+		if (s->db == 0) {
+			if (empty == NULL)
+				empty = s;
+		} else if (s->db == db && !strcmp(s->user, user)) {
+			s->count += count;
+			if (last > s->last)
+				s->last = last;
+			return 1;
+		}
+	}
+	if (empty == NULL)
+		return 0;
+	empty->db = db;
+	empty->count = count;
+	empty->last = last;
+	strcpy(empty->user, user);
+	return 1;
+}
+
+/* private: is a flush of db due?  if so, the caller is the one to do it */
+static int
+wb_due(unsigned int db, int interval, time_t now)
+{
+	int i, oldest = 0, due = 0;
+
+	shm_lock(&wb->lock);
+	for (i = 0; i < WB_TIMERS; i++) {
+		if (wb->timer[i].db == db)
+			break;
+		if (wb->timer[i].flushed < wb->timer[oldest].flushed)
+			oldest = i;
+	}
+	if (i == WB_TIMERS) {
+		i = oldest;
+		wb->timer[i].db = db;
+		wb->timer[i].flushed = 0;
+	}
+	if (now - wb->timer[i].flushed >= interval) {
+		wb->timer[i].flushed = now;
+		due = 1;
+	}
+	shm_unlock(&wb->lock);
+	return due;
+}
+
+/* private: key of the events going to this connection string through this query */
+static unsigned int
+wb_key(modopt_t *options, const char *query)
+{
+	return wb_hash(query, wb_hash(db_connstr(options), 2166136261u));
+}
+
+/* private: write the pending events for db with the batch query */
+static void
+wb_flush(modopt_t *options, const char *query, unsigned int db)
+{
+	struct wb_slot *rows;
+	char **params, *sql, *p, num[2][32];
+	const char *v;
+	PGconn *conn;
+	PGresult *res;
+	int n = 0, i, ok = 0, expanded = 0;
+
+	rows = malloc(WB_BATCH * sizeof(struct wb_slot));
+
+	/* take the rows out, so logins meanwhile start new ones */
+	shm_lock(&wb->lock);
+	for (i = 0; i < WB_SLOTS && n < WB_BATCH; i++) {
+		if (wb->slot[i].db == db) {
+			rows[n++] = wb->slot[i];
+			wb->slot[i].db = 0;
+		}
+	}
+	shm_unlock(&wb->lock);
+
+	if (n == 0) {
+		free(rows);
+		return;
+	}
+
+	/* %V -> VALUES (...), (...) */
+	sql = malloc(strlen(query) + n * 80 + 16);
+	for (p = sql, v = query; *v; v++) {
+		if (v[0] == '%' && v[1] == 'V' && !expanded++) {
+			p += sprintf(p, "VALUES ");
+			for (i = 0; i < n; i++)
+				p += sprintf(p, "%s($%d::text, $%d::integer, to_timestamp($%d::bigint))",
+				    i ? ", " : "", 3 * i + 1, 3 * i + 2, 3 * i + 3);
+			v++;
+		} else {
+			*p++ = *v;
+		}
+	}
+	*p = '\0';
+
+	params = malloc(3 * n * sizeof(char *));
+	for (i = 0; i < n; i++) {
+		params[3 * i] = rows[i].user;
+		sprintf(num[0], "%d", rows[i].count);
+		sprintf(num[1], "%lld", (long long) rows[i].last);
+		params[3 * i + 1] = strdup(num[0]);
+		params[3 * i + 2] = strdup(num[1]);
+	}
+
+	DBGLOG("write-behind: flushing %d rows: %s", n, query);
+	if ((conn = db_connect(options)) != NULL) {
+		res = PQexecParams(conn, sql, 3 * n, NULL, (const char **) params, NULL, NULL, 0);
+		if (PQresultStatus(res) == PGRES_COMMAND_OK || PQresultStatus(res) == PGRES_TUPLES_OK)
+			ok = 1;
+		else
+			SYSLOG("PostgreSQL query failed: '%s'", PQresultErrorMessage(res));
+		PQclear(res);
+		db_release(options, conn);
+	}
+
+	/* keep what couldn't be written for the next attempt */
+	if (!ok) {
+		shm_lock(&wb->lock);
+		for (i = 0; i < n; i++)
+			if (!wb_add(db, rows[i].user, rows[i].count, rows[i].last))
+				SYSLOG("write-behind: table full, dropped %d events of %s", rows[i].count, rows[i].user);
+		shm_unlock(&wb->lock);
+	}
+
+	for (i = 0; i < n; i++) {
+		free(params[3 * i + 1]);
+		free(params[3 * i + 2]);
+	}
+	free(params);
+	free(sql);
+	free(rows);
+}
+
+int
+write_behind_record(modopt_t *options, int kind, const char *user)
+{
+	const char *query, *batch[2];
+	time_t now;
+	int added, i;
+
+	batch[WB_SUCCESS] = options->query_auth_succ_batch;
+	batch[WB_FAILURE] = options->query_auth_fail_batch;
+	query = batch[kind];
+	if (query == NULL || user == NULL || strlen(user) >= WB_USERLEN)
+		return PAM_SERVICE_ERR;
+	if (wb == NULL && (wb = shm_attach(WB_SHM, sizeof(struct wb_table))) == NULL)
+		return PAM_BUF_ERR;
+
+	now = time(NULL);
+	shm_lock(&wb->lock);
+	added = wb_add(wb_key(options, query), user, 1, now);
+	shm_unlock(&wb->lock);
+
+	for (i = 0; i < 2; i++)
+		if (batch[i] && wb_due(wb_key(options, batch[i]), options->write_behind_interval, now))
+			wb_flush(options, batch[i], wb_key(options, batch[i]));
+
+	return added ? PAM_SUCCESS : PAM_BUF_ERR;
+}
@@ -0,0 +1,11 @@
+#ifndef __PAM_PGSQL_WRITE_BEHIND_H
+#define __PAM_PGSQL_WRITE_BEHIND_H
+
+#include "pam_pgsql_options.h"
+
+#define WB_SUCCESS  0
+#define WB_FAILURE  1
+
+int write_behind_record(modopt_t *options, int kind, const char *user);
+
+#endif
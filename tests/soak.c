@@ -0,0 +1,197 @@
+/*
+ * Sample application to soak the module: runs authenticate, acct_mgmt,
+ * open_session, close_session and chauthtok over and over on one PAM
+ * handle, the way a long running daemon does, and fails if any call
+ * fails or the resident size or the number of live allocations keeps
+ * growing.  There is no stand-in database: point the "pgsql" service at
+ * a scratch PostgreSQL database before running it.  chauthtok sets the
+ * password to what it already is, so don't configure password history
+ * or breach checks for that service.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+
+#define SOAK_RSS_SLACK      (1024 * 1024)	/* bytes of RSS growth tolerated */
+#define SOAK_ALLOC_SLACK    1000		/* live allocations tolerated */
+
+#ifdef __GLIBC__
+/* count live allocations, malloc and friends of the whole process end up here */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+static long live = 0;
+
+/* private: count p if the allocation worked */
+static void *
+counted(void *p)
+{
+	if (p != NULL)
+		__atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+void *malloc(size_t size)
+{
+	return counted(__libc_malloc(size));
+}
+
+void *calloc(size_t n, size_t size)
+{
+	return counted(__libc_calloc(n, size));
+}
+
+void *realloc(void *old, size_t size)
+{
+	void *p = __libc_realloc(old, size);
+
+	if (old == NULL && p != NULL)
+		__atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+	else if (old != NULL && size == 0)
+		__atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+/* glibc's reallocarray doesn't go through realloc */
+void *reallocarray(void *old, size_t n, size_t size)
+{
+	if (size != 0 && n > (size_t) -1 / size)
+		return NULL;
+	return realloc(old, n * size);
+}
+
+/* the aligned allocators don't go through malloc either, their blocks are freed all the same */
+void *memalign(size_t align, size_t size)
+{
+	return counted(__libc_memalign(align, size));
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return counted(__libc_memalign(align, size));
+}
+
+void *valloc(size_t size)
+{
+	return counted(__libc_memalign(sysconf(_SC_PAGESIZE), size));
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	if (align < sizeof(void *) || (align & (align - 1)) != 0)
+		return EINVAL;
+	if ((*p = counted(__libc_memalign(align, size))) == NULL)
+		return ENOMEM;
+	return 0;
+}
+
+void free(void *p)
+{
+	if (p != NULL)
+		__atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
+	__libc_free(p);
+}
+#define LIVE() __atomic_load_n(&live, __ATOMIC_RELAXED)
+#else
+#define LIVE() 0L
+#endif
+
+/* answer every prompt with the password */
+static int
+soak_conv(int n, const struct pam_message **msg, struct pam_response **resp, void *password)
+{
+	struct pam_response *r;
+	int i;
+
+	if ((r = calloc(n, sizeof(struct pam_response))) == NULL)
+		return PAM_BUF_ERR;
+	for (i = 0; i < n; i++)
+		if (msg[i]->msg_style == PAM_PROMPT_ECHO_OFF || msg[i]->msg_style == PAM_PROMPT_ECHO_ON)
+			r[i].resp = strdup(password);
+	*resp = r;
+	return PAM_SUCCESS;
+}
+
+/* resident size in bytes */
+static long
+rss(void)
+{
+	FILE *fp;
+	long size, resident = 0;
+
+	if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+		if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	pam_handle_t *pamh = NULL;
+	struct pam_conv conv = { soak_conv, NULL };
+	long calls = 1000000, warmup, i, rss0 = 0, live0 = 0;
+	int retval, failed = 0;
+
+	if (argc == 4)
+		calls = atol(argv[3]);
+	if (argc < 3 || argc > 4 || calls <= 0) {
+		fprintf(stderr, "Usage: soak username password [calls]\n");
+		exit(1);
+	}
+	conv.appdata_ptr = argv[2];
+
+	/* pools, caches and shared memory fill up first, measure after that */
+	warmup = calls / 100 > 1000 ? calls / 100 : 1000;
+	if (warmup > calls)
+		warmup = calls;
+
+	if ((retval = pam_start("pgsql", argv[1], &conv, &pamh)) != PAM_SUCCESS) {
+		fprintf(stderr, "pam_start failed: %d\n", retval);
+		exit(1);
+	}
+
+	for (i = 1; i <= calls; i++) {
+		if ((retval = pam_authenticate(pamh, 0)) == PAM_SUCCESS &&
+		    (retval = pam_acct_mgmt(pamh, 0)) == PAM_SUCCESS &&
+		    (retval = pam_open_session(pamh, 0)) == PAM_SUCCESS &&
+		    (retval = pam_close_session(pamh, 0)) == PAM_SUCCESS)
+			retval = pam_chauthtok(pamh, 0);
+		if (retval != PAM_SUCCESS && !failed++)
+			printf("call %ld failed: %s\n", i, pam_strerror(pamh, retval));
+
+		if (i == warmup) {
+			rss0 = rss();
+			live0 = LIVE();
+		}
+		if (i % (calls / 10 ? calls / 10 : 1) == 0)
+			printf("%ld calls: rss %ld kB, %ld live allocations\n", i, rss() / 1024, LIVE());
+	}
+
+	retval = 0;
+	if (rss() - rss0 > SOAK_RSS_SLACK) {
+		printf("RSS grew by %ld kB after the warm up\n", (rss() - rss0) / 1024);
+		retval = 1;
+	}
+	if (LIVE() - live0 > SOAK_ALLOC_SLACK) {
+		printf("%ld allocations more than after the warm up\n", LIVE() - live0);
+		retval = 1;
+	}
+	if (failed) {
+		printf("%d of %ld calls failed\n", failed, calls);
+		retval = 1;
+	}
+
+	pam_end(pamh, PAM_SUCCESS);
+	return retval;
+}